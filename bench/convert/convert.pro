@@ -0,0 +1,10 @@
+TEMPLATE = app
+CONFIG = release console qt
+QT -= gui
+
+TARGET = convertbench
+OBJECTS_DIR = tmp
+
+HEADERS = ../../src/convert.h
+SOURCES = main.cpp ../../src/convert.cpp
+INCLUDEPATH += ../../include ../../src
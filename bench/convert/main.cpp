@@ -0,0 +1,101 @@
+#include <cstdio>
+#include <cstring>
+
+#include <QVector>
+#include <QElapsedTimer>
+
+#include "convert.h"
+
+// Times the conversions of a full HD frame with the vector kernels against the scalar ones and checks that
+// both give the same pixels.
+
+enum { Width = 1920, Height = 1080, Runs = 50 };
+
+struct Case
+{
+  const char* name;
+  PixmapFormat format;
+  int stride;
+  int size;
+};
+
+unsigned int seed = 12345;
+
+unsigned int nextRandom()
+{
+  seed = seed*1103515245u+12345u;
+  return seed>>8;
+}
+
+void fill(QVector<unsigned char>& data,PixmapFormat format)
+{
+  if (format==PixmapGrayFloat)
+  {
+    float* values = (float*)data.data();
+
+    // quarter steps of the 0..255 output hit the halfway cases of the rounding
+    for(int i=0;i<data.size()/4;i++) values[i] = (float)(nextRandom()%1200)/1020.0f-0.05f;
+    return;
+  }
+
+  for(int i=0;i<data.size();i++) data[i] = (unsigned char)nextRandom();
+}
+
+double timeConversion(const ConvertSource& source,QVector<unsigned char>& dst)
+{
+  QElapsedTimer clock;
+  clock.start();
+
+  for(int i=0;i<Runs;i++) convertToARGB32(source,0,0,Width,Height,dst.data(),Width*4);
+
+  return (double)clock.nsecsElapsed()/1000000.0/Runs;
+}
+
+int main()
+{
+  const Case cases[] =
+  {
+    { "RGB32",     PixmapRGB32,     Width*4, Width*4*Height },
+    { "RGB888",    PixmapRGB888,    Width*3, Width*3*Height },
+    { "BGR888",    PixmapBGR888,    Width*3, Width*3*Height },
+    { "Gray8",     PixmapGray8,     Width,   Width*Height },
+    { "Gray16",    PixmapGray16,    Width*2, Width*2*Height },
+    { "GrayFloat", PixmapGrayFloat, Width*4, Width*4*Height },
+    { "NV12",      PixmapNV12,      Width,   Width*Height*3/2 },
+    { "YUV420",    PixmapYUV420,    Width,   Width*Height*3/2 }
+  };
+
+  QVector<unsigned char> scalar(Width*Height*4);
+  QVector<unsigned char> vector(Width*Height*4);
+
+  bool same = true;
+
+  printf("%-10s %10s %10s %8s\n","format","scalar ms","vector ms","speedup");
+
+  for(unsigned int c=0;c<sizeof(cases)/sizeof(cases[0]);c++)
+  {
+    QVector<unsigned char> data(cases[c].size);
+    fill(data,cases[c].format);
+
+    ConvertSource source;
+    source.data = data.constData();
+    source.stride = cases[c].stride;
+    source.frameHeight = Height;
+    source.format = cases[c].format;
+    source.low = 0.0f;
+    source.high = 0.0f;
+
+    convertScalarOnly = true;
+    double scalarMs = timeConversion(source,scalar);
+
+    convertScalarOnly = false;
+    double vectorMs = timeConversion(source,vector);
+
+    bool match = (memcmp(scalar.constData(),vector.constData(),scalar.size())==0);
+    if (!match) same = false;
+
+    printf("%-10s %10.3f %10.3f %7.2fx%s\n",cases[c].name,scalarMs,vectorMs,scalarMs/vectorMs,match ? "" : "  MISMATCH");
+  }
+
+  return same ? 0 : 1;
+}
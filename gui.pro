@@ -5,8 +5,8 @@ DESTDIR = lib
 OBJECTS_DIR = tmp
 MOC_DIR = tmp
 
-HEADERS = include/gui.h src/widgets.h
-SOURCES = src/gui.cpp
+HEADERS = include/gui.h src/widgets.h src/convert.h src/tiles.h
+SOURCES = src/gui.cpp src/convert.cpp src/tiles.cpp
 INCLUDEPATH += include
 
 DEFINES += GUI_EXPORTS
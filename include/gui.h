@@ -73,6 +73,12 @@ enum SliderTicks
   TicksRight = TicksBelow
 };
 
+enum Orientation
+{
+  OrientationHorizontal = 0x1,
+  OrientationVertical = 0x2
+};
+
 enum FrameShadow
 {
   ShadowPlain = 0x0010,
@@ -90,6 +96,12 @@ enum FrameShape
   ShapeVLine = 0x0005    
 };
 
+enum Interpolation
+{
+  InterpolationNearest,
+  InterpolationBilinear
+};
+
 enum MouseButton
 {
   ButtonLeft = 0x00000001,
@@ -309,6 +321,8 @@ GUI_API Opts& cursor(CursorShape cursor);
 
 GUI_API Opts& focusPolicy(FocusPolicy policy);
 
+// Opts never allocates, so the text is not copied. It has to stay valid for as long as these Opts, or Opts
+// combined from them, are passed to widget functions, an Opts kept across frames keeps pointing to it.
 GUI_API Opts& toolTip(char* text);
 
 // Label, LineEdit, GroupBox
@@ -330,6 +344,9 @@ GUI_API Opts& tracking(bool tracking);
 GUI_API Opts& tickInterval(int interval);
 GUI_API Opts& tickPosition(SliderTicks ticks);
 
+// BindSlider, horizontal by default (HSlider and VSlider have it in their name)
+GUI_API Opts& orientation(Orientation orientation);
+
 // SpinBox
 GUI_API Opts& keyboardTracking(bool tracking);
 GUI_API Opts& decimals(int decimals);
@@ -357,16 +374,137 @@ GUI_API Opts& spacing(int spacing);
 GUI_API Opts& horizontalSpacing(int spacing);
 GUI_API Opts& verticalSpacing(int spacing);
 GUI_API Opts& spacing(int hspacing,int vspacing);
-  
+
+// Pixmap
+GUI_API Opts& zoom(float zoom);
+GUI_API Opts& pan(float x,float y);
+GUI_API Opts& interpolation(Interpolation interpolation);
+
+// points into storage, Opts never allocates
 OptsPrivate* opts;
+
+enum { StorageSize = 320 };
+
+union
+{
+  char data[StorageSize];
+  double alignDouble;
+  void* alignPointer;
+} storage;
+};
+
+// Counters describing the work done by the library during the last frame,
+// i.e. between the two most recent guiUpdate() calls.
+struct GuiStats
+{
+  int optsApplied; // widget/layout properties written by applyOpts
+  int optsSkipped; // properties left untouched because their value did not change
+
+  int widgetsReset; // widgets whose per-frame input state had to be reset
+
+  int idCollisions; // widgets or layouts declared more than once with the same scoped id
+
+  int poolHits;   // widgets taken from a recycle pool instead of being constructed
+  int poolMisses; // pooled classes constructed because their pool was empty
+
+  int layoutActivations; // layouts redone at the end of the frame, at most one per window or container
+
+  int settersSuppressed; // texts, items, ranges and values not pushed to Qt because they did not change
+
+  int layoutMoves; // box layout items moved to restore the declaration order
+
+  int inputUpdates; // guiUpdate() calls since the previous full frame that only pumped input
+
+  int widgetsDeferred; // widgets not constructed because the construction budget ran out
+  int teardownPending; // detached subtrees still waiting to be deleted
+
+  int blocksSkipped; // CacheBegin blocks kept alive without being executed
+
+  int bindingsSynced; // values copied between bound widgets and their variables
 };
 
 GUI_API void guiInit(int& argc,char** argv);
 GUI_API void guiInit();
-GUI_API void guiUpdate(bool wait=false);
-GUI_API void guiUpdateAndWait();
+// Both return true when any input, window resize or close, application timer or guiInvalidate() arrived,
+// false when the next frame would look the same as this one.
+GUI_API bool guiUpdate(bool wait=false);
+GUI_API bool guiUpdateAndWait();
 GUI_API void guiCleanup();
 
+// Marks the window windowId as needing a rebuild, can be called from any thread.
+GUI_API void guiInvalidate(int windowId);
+
+// Sleeps until input arrives or some window is invalidated, returns false when timeoutMs (-1 means
+// no timeout) passed without either.
+GUI_API bool guiWaitForInvalidation(int timeoutMs);
+
+// True when the window windowId received input or was invalidated since the last guiUpdate().
+GUI_API bool guiWindowInvalidated(int windowId);
+
+GUI_API void guiStats(GuiStats* stats);
+
+// Scoped ids of the widgets whose value was changed by the user since the last guiUpdate(), compare them
+// with GetID() called in the scope the widget was declared in. The second variant lists only the widgets
+// of the window windowId. The array stays valid until the next call.
+GUI_API const unsigned long long* guiChangedWidgets(int* count);
+GUI_API const unsigned long long* guiChangedWidgets(int windowId,int* count);
+
+// Leaf widgets that vanish from the frame are hidden into a per-class pool and reused by the next
+// widget of the same class. capacity limits the pool of each class, 0 disables recycling.
+GUI_API void guiSetWidgetPoolCapacity(int capacity);
+
+// Limits the time spent per frame on constructing new widgets and on deleting vanished ones, in milliseconds
+// (0 means no limit). Widgets over the construction budget are skipped, their functions return as if nothing
+// happened, and get built in the following frames. Vanished widgets are hidden at once and deleted over the
+// following frames. guiUpdate() does not wait for events while there is a backlog.
+GUI_API void guiSetFrameBudget(int creationMs,int teardownMs);
+
+// Display-rate mode for loops that call guiUpdate() much more often than the screen refreshes. Widgets are
+// declared, synchronized, laid out and painted only hz times per second, on deadlines aligned to the display
+// period. guiTimeToSync() returns the microseconds left until the next full frame, 0 when the frame being built
+// is one and the widgets have to be declared. In between, as long as no widget was declared, guiUpdate() only
+// dispatches pending input and returns whether some arrived, repaints and relayouts it causes wait for the next
+// full frame. Key and mouse edges and inputEvents() then cover all the input since the last full frame. 0 turns
+// the mode off.
+GUI_API void guiSetDisplayRate(int hz);
+GUI_API int guiTimeToSync();
+
+enum InputPump
+{
+  InputPumpInGuiUpdate,   // input is dispatched at the end of guiUpdate() only
+  InputPumpAtFrameStart,  // also at the first WindowBegin() of every frame
+  InputPumpAtWindowBegin  // also at every WindowBegin()
+};
+
+// Dispatching the pending input while the frame is being built lets the widget functions return values that
+// reflect the input received up to that moment, instead of the input from before the previous guiUpdate().
+// Input that reaches widgets already declared in the frame, and key or event input dispatched after the frame
+// queried it, is returned by the next frame.
+GUI_API void guiSetInputPump(InputPump pump);
+
+// Called by guiUpdate() for every widget whose function returned a value changed by the user during the frame,
+// with the scoped id of the widget (see GetID()) and the time in microseconds from the dispatch of the input that
+// changed it to that guiUpdate(), so the figure includes the rest of the frame build. 0 removes the hook.
+typedef void (*InputLatencyHook)(unsigned long long id,int microseconds);
+
+GUI_API void guiSetInputLatencyHook(InputLatencyHook hook);
+
+// Ids are scoped: inside WindowBegin/GroupBoxBegin and between PushID/PopID they are hashed
+// together with the enclosing scope, so the same id can be reused in different scopes.
+GUI_API void PushID(int id);
+GUI_API void PushID(const char* str);
+GUI_API void PopID();
+
+// Scoped id that a widget declared with id in the current scope gets
+GUI_API unsigned long long GetID(int id);
+
+// Memoized block, CacheEnd() must be called whether the block was executed or not. When inputsHash and the
+// enclosing layout are the same as in the previous frame and no widget inside received input, CacheBegin returns
+// false and everything the block declared last time stays alive without being declared again. Otherwise it
+// returns true and the block must be executed.
+GUI_API bool CacheBegin(int id,unsigned long long inputsHash);
+GUI_API void CacheEnd();
+
 GUI_API void Label(int id,const char* text,const Opts& opts = Opts());
 
 GUI_API void HSeparator(int id,const Opts& opts = Opts());
@@ -402,6 +540,15 @@ GUI_API bool HScrollBar(int id,float min,float max,float* value,const Opts& opts
 GUI_API bool VScrollBar(int id,int min,int max,int* value,const Opts& opts = Opts());
 GUI_API bool VScrollBar(int id,float min,float max,float* value,const Opts& opts = Opts());
 
+// Retained bindings, registered once instead of being declared every frame. The widget is declared into the
+// current layout like by HSlider(), SpinBox() or CheckBox() and guiUpdate() then keeps it in sync with the
+// variable in both directions. It goes away together with its layout or after Unbind(). Binding the same id
+// again updates the binding.
+GUI_API void BindSlider(int id,float min,float max,float* value,const Opts& opts = Opts());
+GUI_API void BindSpinBox(int id,float min,float max,float* value,const Opts& opts = Opts());
+GUI_API void BindCheckBox(int id,const char* text,bool* state,const Opts& opts = Opts());
+GUI_API void Unbind(int id);
+
 GUI_API void Spacer(int id,const Opts& opts = Opts());
 
 GUI_API void WindowBegin(int id,const char* title,const Opts& opts = Opts());
@@ -424,6 +571,88 @@ GUI_API void PixmapEnd();
 
 GUI_API void pixmapBlit(int width,int height,const unsigned char* data);
 
+// The Pixmap widget owns a persistent ARGB32 image that is kept between frames. pixmapBlit() with a rectangle
+// copies only that rectangle, stride is the byte distance between the rows of data. pixmapLock() gives direct
+// access to the image (sized by pixmapSetSize() or the last full pixmapBlit()), pixmapUnlock() repaints the
+// given dirty rectangle, or the whole image when called without one.
+GUI_API void pixmapBlit(int x,int y,int width,int height,const unsigned char* data,int stride);
+GUI_API void pixmapSetSize(int width,int height);
+
+// Maps a point of the Pixmap widget (as returned by mouseX(), mouseY()) to image coordinates
+// under the current zoom and pan.
+GUI_API void pixmapViewToImage(int x,int y,float* imageX,float* imageY);
+GUI_API void pixmapLock(unsigned char** data,int* stride);
+GUI_API void pixmapUnlock(int x,int y,int width,int height);
+GUI_API void pixmapUnlock();
+
+enum PixmapFormat
+{
+  PixmapARGB32,
+  PixmapRGB32,
+  PixmapRGB888,     // bytes R,G,B
+  PixmapBGR888,     // bytes B,G,R
+  PixmapGray8,
+  PixmapGray16,
+  PixmapGrayFloat,
+  PixmapNV12,       // luma plane followed by interleaved U,V rows of half resolution
+  PixmapYUV420      // luma plane followed by U and V planes of half resolution and half stride
+};
+
+// Converting blits, data is a width x height image in the given format with rows stride bytes apart. The 16-bit
+// and float grayscale values low..high are mapped to 0..255, low==high maps 0..65535 and 0..1 respectively.
+// The conversion is vectorized where the CPU allows, except for NV12 and YUV420 which are converted by scalar
+// code, and split over several threads for large images.
+GUI_API void pixmapBlit(int width,int height,const void* data,int stride,PixmapFormat format,float low = 0.0f,float high = 0.0f);
+GUI_API void pixmapBlit(int x,int y,int width,int height,const void* data,int stride,PixmapFormat format,float low = 0.0f,float high = 0.0f);
+
+// Frames produced by another thread. The producer writes a frame into the buffer returned by feedAcquire()
+// and hands it over with feedPublish(), neither blocks. pixmapFeed(), called between PixmapBegin() and
+// PixmapEnd(), shows the newest published frame without copying it, frames published in between are dropped.
+// Frames in ARGB32 and RGB32 are shown as they are, the other formats are converted when shown, with low and
+// high as in pixmapBlit(). feedAcquire() returns the row stride, planar formats keep their chroma planes right
+// after the luma plane. A feed must not be destroyed while a Pixmap widget still shows it.
+struct PixmapFeed;
+
+struct PixmapFeedStats
+{
+  int published;
+  int displayed;
+  int dropped;
+};
+
+GUI_API PixmapFeed* pixmapFeedCreate(int width,int height,PixmapFormat format,float low = 0.0f,float high = 0.0f);
+GUI_API void pixmapFeedDestroy(PixmapFeed* feed);
+GUI_API unsigned char* feedAcquire(PixmapFeed* feed,int* stride);
+GUI_API void feedPublish(PixmapFeed* feed);
+GUI_API void pixmapFeedStats(PixmapFeed* feed,PixmapFeedStats* stats);
+GUI_API void pixmapFeed(PixmapFeed* feed);
+
+// Images far larger than memory. A tiled image is cut into tiles of TiledImageTileSize pixels on every level of a
+// mip pyramid, level n being downscaled by 2^n. TiledView widgets request the tiles they show from background
+// threads, together with the tiles around them, and keep them in a cache shared by all tiled images where the
+// least recently used tiles are evicted first. tiledImageOpen() maps a raw file, the pixels of the given format
+// start at offset and their rows are stride bytes apart, it returns 0 when the file is too short. The callback
+// of tiledImageCreate() runs on the background threads and fills width x height ARGB32 pixels of a tile, for
+// levels it returns false the tile is built from the level below. A tiled image must not be destroyed while a
+// TiledView widget still shows it.
+enum { TiledImageTileSize = 256 };
+
+struct TiledImage;
+
+typedef bool (*TileCallback)(void* user,int level,int tileX,int tileY,int width,int height,unsigned char* data,int stride);
+
+GUI_API TiledImage* tiledImageOpen(const char* fileName,long long offset,int width,int height,int stride,PixmapFormat format,float low = 0.0f,float high = 0.0f);
+GUI_API TiledImage* tiledImageCreate(int width,int height,TileCallback callback,void* user);
+GUI_API void tiledImageDestroy(TiledImage* image);
+
+// Memory of the tile cache in megabytes, 256 by default
+GUI_API void guiSetTileCacheBudget(int megabytes);
+
+// Shows a tiled image with the zoom, pan and interpolation options of the Pixmap widget. Mouse queries and
+// pixmapViewToImage() work between TiledViewBegin() and TiledViewEnd() as they do for the Pixmap widget.
+GUI_API void TiledViewBegin(int id,TiledImage* image,const Opts& opts = Opts());
+GUI_API void TiledViewEnd();
+
 GUI_API void HBoxLayoutBegin(int id,const Opts& opts = Opts());
 GUI_API void HBoxLayoutEnd();
 
@@ -449,14 +678,71 @@ GUI_API bool mouseUp(MouseButton button);
 GUI_API int mouseX();
 GUI_API int mouseY();
 
+struct MouseMotion
+{
+  int x;
+  int y;
+  int buttons; // MouseButton flags held during the motion
+  int time;    // milliseconds since guiInit()
+};
+
+// Pointer positions received since the previous frame, oldest first, relative to the current widget.
+// The returned array is valid until the next call.
+GUI_API const MouseMotion* mouseMotion(int* count);
+
 GUI_API int mouseWheelDelta();
 
+// Everything the mouse and resize queries of the current widget report, in one call.
+struct MouseState
+{
+  int x;
+  int y;
+  int down;       // MouseButton flags of the buttons that went down this frame
+  int pressed;    // buttons held down since an earlier frame
+  int up;         // buttons released this frame
+  int wheelDelta;
+  bool resized;
+  int width;
+  int height;
+};
+
+GUI_API void mouseState(MouseState* state);
+
 GUI_API bool mouseIsOver();
 
 GUI_API bool keyDown(Key key);
 GUI_API bool keyPressed(Key key);
 GUI_API bool keyUp(Key key);
 
+enum InputEventType
+{
+  InputKeyDown,
+  InputKeyRepeat,
+  InputKeyUp,
+  InputMouseDown,
+  InputMouseUp,
+  InputMouseMove,
+  InputMouseWheel
+};
+
+struct InputEvent
+{
+  InputEventType type;
+  int key;      // Key for key events, MouseButton for button events
+  int text;     // unicode character produced by a key press, 0 if none
+  int x;
+  int y;
+  int buttons;  // MouseButton flags held during a move or button event
+  int delta;    // wheel rotation
+  int time;     // milliseconds since guiInit()
+};
+
+// Keyboard and mouse input received since the previous frame, in arrival order.
+// Positions are relative to the current widget between *Begin/*End, in screen coordinates otherwise.
+// Keys still held when the application loses focus are reported released.
+// The returned array is valid until the next call.
+GUI_API const InputEvent* inputEvents(int* count);
+
 GUI_API bool widgetHasFocus();
 
 class GLContextPrivate;
@@ -0,0 +1,555 @@
+#include <cstring>
+#include <cassert>
+
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+
+#include "convert.h"
+
+// SSE2 is part of every x86-64 target, AVX2 kernels are compiled for the AVX2 target only
+// and chosen at run time.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+  #define CONVERT_SSE2
+  #include <emmintrin.h>
+#endif
+
+#if defined(CONVERT_SSE2) && (defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER>=1700))
+  #define CONVERT_AVX2
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #endif
+#endif
+
+#ifdef __GNUC__
+  #define AVX2_TARGET __attribute__((target("avx2")))
+#else
+  #define AVX2_TARGET
+#endif
+
+struct Window
+{
+  float low;
+  float scale;
+};
+
+typedef void (*RowKernel)(const unsigned char* src,unsigned int* dst,int width,const Window& window);
+
+inline unsigned int grayPixel(unsigned int g)
+{
+  return 0xFF000000u | (g*0x010101u);
+}
+
+inline int clampByte(int v)
+{
+  return (v<0) ? 0 : ((v>255) ? 255 : v);
+}
+
+inline unsigned int windowed(float v,const Window& window)
+{
+  float s = (v-window.low)*window.scale;
+
+  if (!(s>0.0f)) return 0; // NaN too
+  if (s>=255.0f) return 255;
+
+  return (unsigned int)(s+0.5f);
+}
+
+// Scalar kernels, they also finish the rows after the vector kernels.
+
+void rowARGB32(const unsigned char* src,unsigned int* dst,int width,const Window&)
+{
+  memcpy(dst,src,width*4);
+}
+
+void rowRGB32(const unsigned char* src,unsigned int* dst,int width,const Window&)
+{
+  const unsigned int* s = (const unsigned int*)src;
+
+  for(int i=0;i<width;i++) dst[i] = s[i] | 0xFF000000u;
+}
+
+void rowRGB888(const unsigned char* src,unsigned int* dst,int width,const Window&)
+{
+  for(int i=0;i<width;i++,src+=3) dst[i] = 0xFF000000u | (src[0]<<16) | (src[1]<<8) | src[2];
+}
+
+void rowBGR888(const unsigned char* src,unsigned int* dst,int width,const Window&)
+{
+  for(int i=0;i<width;i++,src+=3) dst[i] = 0xFF000000u | (src[2]<<16) | (src[1]<<8) | src[0];
+}
+
+void rowGray8(const unsigned char* src,unsigned int* dst,int width,const Window&)
+{
+  for(int i=0;i<width;i++) dst[i] = grayPixel(src[i]);
+}
+
+void rowGray16(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const unsigned short* s = (const unsigned short*)src;
+
+  for(int i=0;i<width;i++) dst[i] = grayPixel(windowed((float)s[i],window));
+}
+
+void rowGrayFloat(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const float* s = (const float*)src;
+
+  for(int i=0;i<width;i++) dst[i] = grayPixel(windowed(s[i],window));
+}
+
+#ifdef CONVERT_SSE2
+
+// expands 16 gray bytes to 16 opaque ARGB32 pixels
+inline void storeGraySSE2(__m128i g,unsigned int* dst)
+{
+  const __m128i alpha = _mm_set1_epi8((char)0xFF);
+
+  __m128i gg0 = _mm_unpacklo_epi8(g,g);
+  __m128i gg1 = _mm_unpackhi_epi8(g,g);
+  __m128i ga0 = _mm_unpacklo_epi8(g,alpha);
+  __m128i ga1 = _mm_unpackhi_epi8(g,alpha);
+
+  _mm_storeu_si128((__m128i*)(dst+0), _mm_unpacklo_epi16(gg0,ga0));
+  _mm_storeu_si128((__m128i*)(dst+4), _mm_unpackhi_epi16(gg0,ga0));
+  _mm_storeu_si128((__m128i*)(dst+8), _mm_unpacklo_epi16(gg1,ga1));
+  _mm_storeu_si128((__m128i*)(dst+12),_mm_unpackhi_epi16(gg1,ga1));
+}
+
+// maps 4 values through the window to 0..255, rounding like windowed()
+inline __m128i windowSSE2(__m128 v,__m128 low,__m128 scale)
+{
+  __m128 s = _mm_mul_ps(_mm_sub_ps(v,low),scale);
+
+  s = _mm_min_ps(_mm_max_ps(s,_mm_setzero_ps()),_mm_set1_ps(255.0f));
+
+  return _mm_cvttps_epi32(_mm_add_ps(s,_mm_set1_ps(0.5f)));
+}
+
+void rowRGB32SSE2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+
+  int i = 0;
+
+  for(;i+4<=width;i+=4)
+  {
+    _mm_storeu_si128((__m128i*)(dst+i),_mm_or_si128(_mm_loadu_si128((const __m128i*)(src+i*4)),alpha));
+  }
+
+  rowRGB32(src+i*4,dst+i,width-i,window);
+}
+
+void rowGray8SSE2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  int i = 0;
+
+  for(;i+16<=width;i+=16) storeGraySSE2(_mm_loadu_si128((const __m128i*)(src+i)),dst+i);
+
+  rowGray8(src+i,dst+i,width-i,window);
+}
+
+void rowGray16SSE2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const unsigned short* s = (const unsigned short*)src;
+
+  const __m128 low = _mm_set1_ps(window.low);
+  const __m128 scale = _mm_set1_ps(window.scale);
+  const __m128i zero = _mm_setzero_si128();
+
+  int i = 0;
+
+  for(;i+16<=width;i+=16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i*)(s+i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(s+i+8));
+
+    __m128i v0 = windowSSE2(_mm_cvtepi32_ps(_mm_unpacklo_epi16(a,zero)),low,scale);
+    __m128i v1 = windowSSE2(_mm_cvtepi32_ps(_mm_unpackhi_epi16(a,zero)),low,scale);
+    __m128i v2 = windowSSE2(_mm_cvtepi32_ps(_mm_unpacklo_epi16(b,zero)),low,scale);
+    __m128i v3 = windowSSE2(_mm_cvtepi32_ps(_mm_unpackhi_epi16(b,zero)),low,scale);
+
+    storeGraySSE2(_mm_packus_epi16(_mm_packs_epi32(v0,v1),_mm_packs_epi32(v2,v3)),dst+i);
+  }
+
+  rowGray16(src+i*2,dst+i,width-i,window);
+}
+
+void rowGrayFloatSSE2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const float* s = (const float*)src;
+
+  const __m128 low = _mm_set1_ps(window.low);
+  const __m128 scale = _mm_set1_ps(window.scale);
+
+  int i = 0;
+
+  for(;i+16<=width;i+=16)
+  {
+    __m128i v0 = windowSSE2(_mm_loadu_ps(s+i),low,scale);
+    __m128i v1 = windowSSE2(_mm_loadu_ps(s+i+4),low,scale);
+    __m128i v2 = windowSSE2(_mm_loadu_ps(s+i+8),low,scale);
+    __m128i v3 = windowSSE2(_mm_loadu_ps(s+i+12),low,scale);
+
+    storeGraySSE2(_mm_packus_epi16(_mm_packs_epi32(v0,v1),_mm_packs_epi32(v2,v3)),dst+i);
+  }
+
+  rowGrayFloat(src+i*4,dst+i,width-i,window);
+}
+
+#endif
+
+#ifdef CONVERT_AVX2
+
+// turns 8 gray values 0..255 into 8 opaque ARGB32 pixels
+AVX2_TARGET inline __m256i grayAVX2(__m256i g)
+{
+  return _mm256_or_si256(_mm256_mullo_epi32(g,_mm256_set1_epi32(0x010101)),_mm256_set1_epi32((int)0xFF000000u));
+}
+
+AVX2_TARGET inline __m256i windowAVX2(__m256 v,__m256 low,__m256 scale)
+{
+  __m256 s = _mm256_mul_ps(_mm256_sub_ps(v,low),scale);
+
+  s = _mm256_min_ps(_mm256_max_ps(s,_mm256_setzero_ps()),_mm256_set1_ps(255.0f));
+
+  return _mm256_cvttps_epi32(_mm256_add_ps(s,_mm256_set1_ps(0.5f)));
+}
+
+AVX2_TARGET void rowRGB32AVX2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const __m256i alpha = _mm256_set1_epi32((int)0xFF000000u);
+
+  int i = 0;
+
+  for(;i+8<=width;i+=8)
+  {
+    _mm256_storeu_si256((__m256i*)(dst+i),_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(src+i*4)),alpha));
+  }
+
+  rowRGB32(src+i*4,dst+i,width-i,window);
+}
+
+// 8 pixels per iteration, each 128-bit lane shuffles 4 packed pixels into place, returns the pixels done
+AVX2_TARGET int rowPacked24AVX2(const unsigned char* src,unsigned int* dst,int width,const __m256i& shuffle)
+{
+  const __m256i alpha = _mm256_set1_epi32((int)0xFF000000u);
+
+  int i = 0;
+
+  // the second load reads 4 bytes past the 8th pixel
+  for(;i+10<=width;i+=8)
+  {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(src+i*3));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(src+i*3+12));
+
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),hi,1);
+
+    _mm256_storeu_si256((__m256i*)(dst+i),_mm256_or_si256(_mm256_shuffle_epi8(v,shuffle),alpha));
+  }
+
+  return i;
+}
+
+AVX2_TARGET void rowRGB888AVX2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const __m256i shuffle = _mm256_setr_epi8(2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1,
+                                           2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1);
+
+  int i = rowPacked24AVX2(src,dst,width,shuffle);
+
+  rowRGB888(src+i*3,dst+i,width-i,window);
+}
+
+AVX2_TARGET void rowBGR888AVX2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const __m256i shuffle = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                           0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+
+  int i = rowPacked24AVX2(src,dst,width,shuffle);
+
+  rowBGR888(src+i*3,dst+i,width-i,window);
+}
+
+AVX2_TARGET void rowGray8AVX2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  int i = 0;
+
+  for(;i+8<=width;i+=8)
+  {
+    __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src+i)));
+    _mm256_storeu_si256((__m256i*)(dst+i),grayAVX2(g));
+  }
+
+  rowGray8(src+i,dst+i,width-i,window);
+}
+
+AVX2_TARGET void rowGray16AVX2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const unsigned short* s = (const unsigned short*)src;
+
+  const __m256 low = _mm256_set1_ps(window.low);
+  const __m256 scale = _mm256_set1_ps(window.scale);
+
+  int i = 0;
+
+  for(;i+8<=width;i+=8)
+  {
+    __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(s+i))));
+    _mm256_storeu_si256((__m256i*)(dst+i),grayAVX2(windowAVX2(v,low,scale)));
+  }
+
+  rowGray16(src+i*2,dst+i,width-i,window);
+}
+
+AVX2_TARGET void rowGrayFloatAVX2(const unsigned char* src,unsigned int* dst,int width,const Window& window)
+{
+  const float* s = (const float*)src;
+
+  const __m256 low = _mm256_set1_ps(window.low);
+  const __m256 scale = _mm256_set1_ps(window.scale);
+
+  int i = 0;
+
+  for(;i+8<=width;i+=8)
+  {
+    _mm256_storeu_si256((__m256i*)(dst+i),grayAVX2(windowAVX2(_mm256_loadu_ps(s+i),low,scale)));
+  }
+
+  rowGrayFloat(src+i*4,dst+i,width-i,window);
+}
+
+#endif
+
+bool cpuHasAVX2()
+{
+#if defined(CONVERT_AVX2) && defined(__GNUC__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#elif defined(CONVERT_AVX2) && defined(_MSC_VER)
+  int info[4];
+
+  __cpuid(info,0);
+  if (info[0]<7) return false;
+
+  // the OS has to save the YMM registers
+  __cpuid(info,1);
+  if ((info[2] & (1<<27))==0 || (info[2] & (1<<28))==0) return false;
+  if ((_xgetbv(0) & 6)!=6) return false;
+
+  __cpuidex(info,7,0);
+  return (info[1] & (1<<5))!=0;
+#else
+  return false;
+#endif
+}
+
+const bool hasAVX2 = cpuHasAVX2();
+
+bool convertScalarOnly = false;
+
+RowKernel rowKernel(PixmapFormat format)
+{
+#ifdef CONVERT_AVX2
+  if (hasAVX2 && !convertScalarOnly)
+  {
+    switch(format)
+    {
+      case PixmapRGB32:     return rowRGB32AVX2;
+      case PixmapRGB888:    return rowRGB888AVX2;
+      case PixmapBGR888:    return rowBGR888AVX2;
+      case PixmapGray8:     return rowGray8AVX2;
+      case PixmapGray16:    return rowGray16AVX2;
+      case PixmapGrayFloat: return rowGrayFloatAVX2;
+      default: break;
+    }
+  }
+#endif
+
+#ifdef CONVERT_SSE2
+  if (!convertScalarOnly)
+  {
+    switch(format)
+    {
+      case PixmapRGB32:     return rowRGB32SSE2;
+      case PixmapGray8:     return rowGray8SSE2;
+      case PixmapGray16:    return rowGray16SSE2;
+      case PixmapGrayFloat: return rowGrayFloatSSE2;
+      default: break;
+    }
+  }
+#endif
+
+  switch(format)
+  {
+    case PixmapARGB32:    return rowARGB32;
+    case PixmapRGB32:     return rowRGB32;
+    case PixmapRGB888:    return rowRGB888;
+    case PixmapBGR888:    return rowBGR888;
+    case PixmapGray8:     return rowGray8;
+    case PixmapGray16:    return rowGray16;
+    case PixmapGrayFloat: return rowGrayFloat;
+    default: break;
+  }
+
+  return 0;
+}
+
+int bytesPerPixel(PixmapFormat format)
+{
+  switch(format)
+  {
+    case PixmapRGB888:
+    case PixmapBGR888:    return 3;
+    case PixmapGray8:
+    case PixmapNV12:
+    case PixmapYUV420:    return 1;
+    case PixmapGray16:    return 2;
+    default:              return 4;
+  }
+}
+
+// BT.601 limited range
+inline unsigned int yuvPixel(int y,int u,int v)
+{
+  int c = 298*(y-16)+128;
+  int d = u-128;
+  int e = v-128;
+
+  int r = clampByte((c+409*e)>>8);
+  int g = clampByte((c-100*d-208*e)>>8);
+  int b = clampByte((c+516*d)>>8);
+
+  return 0xFF000000u | (r<<16) | (g<<8) | b;
+}
+
+void convertYUVRow(const ConvertSource& source,int x,int y,int width,unsigned int* dst)
+{
+  const unsigned char* luma = source.data+y*source.stride+x;
+  const unsigned char* chroma = source.data+source.stride*source.frameHeight;
+
+  if (source.format==PixmapNV12)
+  {
+    const unsigned char* uv = chroma+(y/2)*source.stride;
+
+    for(int i=0;i<width;i++)
+    {
+      int c = ((x+i)/2)*2;
+      dst[i] = yuvPixel(luma[i],uv[c],uv[c+1]);
+    }
+  }
+  else
+  {
+    int chromaStride = source.stride/2;
+
+    const unsigned char* u = chroma+(y/2)*chromaStride;
+    const unsigned char* v = chroma+chromaStride*((source.frameHeight+1)/2)+(y/2)*chromaStride;
+
+    for(int i=0;i<width;i++)
+    {
+      int c = (x+i)/2;
+      dst[i] = yuvPixel(luma[i],u[c],v[c]);
+    }
+  }
+}
+
+// rows first..last-1 of the region
+void convertRows(const ConvertSource& source,int x,int y,int width,int first,int last,unsigned char* dst,int dstStride)
+{
+  if (source.format==PixmapNV12 || source.format==PixmapYUV420)
+  {
+    for(int row=first;row<last;row++) convertYUVRow(source,x,y+row,width,(unsigned int*)(dst+row*dstStride));
+    return;
+  }
+
+  Window window;
+
+  float low = source.low;
+  float high = source.high;
+
+  if (low==high)
+  {
+    low = 0.0f;
+    high = (source.format==PixmapGray16) ? 65535.0f : 1.0f;
+  }
+
+  window.low = low;
+  window.scale = 255.0f/(high-low);
+
+  RowKernel kernel = rowKernel(source.format);
+  assert(kernel!=0);
+
+  int bpp = bytesPerPixel(source.format);
+
+  for(int row=first;row<last;row++)
+  {
+    kernel(source.data+(y+row)*source.stride+x*bpp,(unsigned int*)(dst+row*dstStride),width,window);
+  }
+}
+
+struct StripBatch
+{
+  QMutex mutex;
+  QWaitCondition done;
+  int remaining;
+};
+
+class ConvertStrip : public QRunnable
+{
+public:
+  ConvertStrip(const ConvertSource& source,int x,int y,int width,int first,int last,unsigned char* dst,int dstStride,StripBatch* batch)
+    : source(source), x(x), y(y), width(width), first(first), last(last), dst(dst), dstStride(dstStride), batch(batch) {}
+
+  void run()
+  {
+    convertRows(source,x,y,width,first,last,dst,dstStride);
+
+    QMutexLocker locker(&batch->mutex);
+    if (--batch->remaining==0) batch->done.wakeAll();
+  }
+
+  ConvertSource source;
+  int x,y,width,first,last;
+  unsigned char* dst;
+  int dstStride;
+  StripBatch* batch;
+};
+
+// below this the strips would not pay for the thread hand-off
+enum { ParallelPixels = 512*512, MinStripRows = 32 };
+
+void convertToARGB32(const ConvertSource& source,int x,int y,int width,int height,unsigned char* dst,int dstStride)
+{
+  int strips = 1;
+
+  if (width*height>=ParallelPixels)
+  {
+    strips = QThread::idealThreadCount();
+    if (strips>height/MinStripRows) strips = height/MinStripRows;
+    if (strips<1) strips = 1;
+  }
+
+  if (strips==1)
+  {
+    convertRows(source,x,y,width,0,height,dst,dstStride);
+    return;
+  }
+
+  StripBatch batch;
+  batch.remaining = strips-1;
+
+  // the calling thread converts the first strip itself
+  for(int i=1;i<strips;i++)
+  {
+    QThreadPool::globalInstance()->start(new ConvertStrip(source,x,y,width,(height*i)/strips,(height*(i+1))/strips,dst,dstStride,&batch));
+  }
+
+  convertRows(source,x,y,width,0,height/strips,dst,dstStride);
+
+  QMutexLocker locker(&batch.mutex);
+  while (batch.remaining>0) batch.done.wait(&batch.mutex);
+}
@@ -0,0 +1,28 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <gui.h>
+
+// Source of a conversion. Planar formats (NV12, YUV420) keep their chroma planes right after the luma plane
+// of frameHeight rows, the chroma rows are stride bytes (NV12) or stride/2 bytes (YUV420) long.
+struct ConvertSource
+{
+  const unsigned char* data;
+  int stride;
+  int frameHeight;
+  PixmapFormat format;
+  float low;   // window of the 16-bit and float grayscale formats, mapped to 0..255
+  float high;
+};
+
+// Size of one pixel of the source, of the luma plane for the planar formats
+int bytesPerPixel(PixmapFormat format);
+
+// Restricts the conversions to the scalar kernels, the benchmark compares the vector kernels against them
+extern bool convertScalarOnly;
+
+// Converts the width x height pixels at x,y of the source to ARGB32 pixels at dst. Large images are
+// converted in parallel strips.
+void convertToARGB32(const ConvertSource& source,int x,int y,int width,int height,unsigned char* dst,int dstStride);
+
+#endif
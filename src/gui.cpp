@@ -1,7 +1,9 @@
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cassert>
 #include <cmath>
+#include <new>
 
 #include <QObject>
 #include <QSpinBox>
@@ -27,6 +29,9 @@
 #include <QMenuBar>
 #include <QMenu>
 #include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QAtomicInt>
 #include <QIntValidator>
 #include <QDoubleValidator>
 #include <QImage>
@@ -44,149 +49,545 @@
 #include <QGLWidget>
 
 #include "widgets.h"
+#include "convert.h"
+#include "tiles.h"
 
 #include <gui.h>
 
+enum OptId
+{
+  OptAlign,
+  OptStretch,
+  OptGridRow,
+  OptGridColumn,
+  OptGridRowSpan,
+  OptGridColumnSpan,
+  OptSizePolicy,
+  OptMinimumWidth,
+  OptMinimumHeight,
+  OptMaximumWidth,
+  OptMaximumHeight,
+  OptInitialGeometryX,
+  OptInitialGeometryY,
+  OptInitialGeometryWidth,
+  OptInitialGeometryHeight,
+  OptMarginLeft,
+  OptMarginTop,
+  OptMarginRight,
+  OptMarginBottom,
+  OptEnabled,
+  OptCursor,
+  OptFocusPolicy,
+  OptToolTip,
+  OptAlignText,
+  OptReadOnly,
+  OptTracking,
+  OptSingleStep,
+  OptPageStep,
+  OptFloatSingleStep,
+  OptFloatPageStep,
+  OptTickInterval,
+  OptTickPosition,
+  OptOrientation,
+  OptKeyboardTracking,
+  OptDecimals,
+  OptFrameShape,
+  OptFrameShadow,
+  OptFrameLineWidth,
+  OptFrameMidLineWidth,
+  OptModal,
+  OptShowFrame,
+  OptShowTitleBar,
+  OptShowMinimizeButton,
+  OptShowMaximizeButton,
+  OptShowCloseButton,
+  OptShowSystemMenu,
+  OptStayOnTop,
+  OptSizeConstraint,
+  OptSpacing,
+  OptHorizontalSpacing,
+  OptVerticalSpacing,
+  OptZoom,
+  OptPanX,
+  OptPanY,
+  OptInterpolation,
+  OptCount
+};
+
+enum OptType
+{
+  OptTypeInt,
+  OptTypeBool,
+  OptTypeFloat,
+  OptTypeSizePolicy,
+  OptTypeCursor,
+  OptTypeString
+};
+
+struct OptInfo
+{
+  const char* property; // Qt property written by applyOpts, 0 when the option is consumed by the library itself
+  OptType type;
+};
+
+// indexed by OptId
+const OptInfo optInfo[OptCount] =
+{
+  { 0,                   OptTypeInt        }, // OptAlign
+  { 0,                   OptTypeInt        }, // OptStretch
+  { 0,                   OptTypeInt        }, // OptGridRow
+  { 0,                   OptTypeInt        }, // OptGridColumn
+  { 0,                   OptTypeInt        }, // OptGridRowSpan
+  { 0,                   OptTypeInt        }, // OptGridColumnSpan
+  { "sizePolicy",        OptTypeSizePolicy }, // OptSizePolicy
+  { "minimumWidth",      OptTypeInt        }, // OptMinimumWidth
+  { "minimumHeight",     OptTypeInt        }, // OptMinimumHeight
+  { "maximumWidth",      OptTypeInt        }, // OptMaximumWidth
+  { "maximumHeight",     OptTypeInt        }, // OptMaximumHeight
+  { 0,                   OptTypeInt        }, // OptInitialGeometryX
+  { 0,                   OptTypeInt        }, // OptInitialGeometryY
+  { 0,                   OptTypeInt        }, // OptInitialGeometryWidth
+  { 0,                   OptTypeInt        }, // OptInitialGeometryHeight
+  { 0,                   OptTypeInt        }, // OptMarginLeft
+  { 0,                   OptTypeInt        }, // OptMarginTop
+  { 0,                   OptTypeInt        }, // OptMarginRight
+  { 0,                   OptTypeInt        }, // OptMarginBottom
+  { "enabled",           OptTypeBool       }, // OptEnabled
+  { "cursor",            OptTypeCursor     }, // OptCursor
+  { "focusPolicy",       OptTypeInt        }, // OptFocusPolicy
+  { "toolTip",           OptTypeString     }, // OptToolTip
+  { "alignment",         OptTypeInt        }, // OptAlignText
+  { "readOnly",          OptTypeBool       }, // OptReadOnly
+  { "tracking",          OptTypeBool       }, // OptTracking
+  { "singleStep",        OptTypeInt        }, // OptSingleStep
+  { "pageStep",          OptTypeInt        }, // OptPageStep
+  { 0,                   OptTypeFloat      }, // OptFloatSingleStep
+  { 0,                   OptTypeFloat      }, // OptFloatPageStep
+  { "tickInterval",      OptTypeInt        }, // OptTickInterval
+  { "tickPosition",      OptTypeInt        }, // OptTickPosition
+  { 0,                   OptTypeInt        }, // OptOrientation
+  { "keyboardTracking",  OptTypeBool       }, // OptKeyboardTracking
+  { "decimals",          OptTypeInt        }, // OptDecimals
+  { "frameShape",        OptTypeInt        }, // OptFrameShape
+  { "frameShadow",       OptTypeInt        }, // OptFrameShadow
+  { "lineWidth",         OptTypeInt        }, // OptFrameLineWidth
+  { "midLineWidth",      OptTypeInt        }, // OptFrameMidLineWidth
+  { 0,                   OptTypeBool       }, // OptModal
+  { 0,                   OptTypeBool       }, // OptShowFrame
+  { 0,                   OptTypeBool       }, // OptShowTitleBar
+  { 0,                   OptTypeBool       }, // OptShowMinimizeButton
+  { 0,                   OptTypeBool       }, // OptShowMaximizeButton
+  { 0,                   OptTypeBool       }, // OptShowCloseButton
+  { 0,                   OptTypeBool       }, // OptShowSystemMenu
+  { 0,                   OptTypeBool       }, // OptStayOnTop
+  { "sizeConstraint",    OptTypeInt        }, // OptSizeConstraint
+  { "spacing",           OptTypeInt        }, // OptSpacing
+  { "horizontalSpacing", OptTypeInt        }, // OptHorizontalSpacing
+  { "verticalSpacing",   OptTypeInt        }, // OptVerticalSpacing
+  { 0,                   OptTypeFloat      }, // OptZoom
+  { 0,                   OptTypeFloat      }, // OptPanX
+  { 0,                   OptTypeFloat      }, // OptPanY
+  { 0,                   OptTypeInt        }  // OptInterpolation
+};
+
+union OptValue
+{
+  int i;
+  float f;
+};
+
+template<typename T> T optValue(const OptValue& value);
+template<> int optValue<int>(const OptValue& value) { return value.i; }
+template<> bool optValue<bool>(const OptValue& value) { return value.i!=0; }
+template<> float optValue<float>(const OptValue& value) { return value.f; }
+
+// Fixed-size option record, lives inline in Opts::storage.
+// Every option has its own typed slot, mask tells which of them were set.
 class OptsPrivate
 {
 public:  
-  OptsPrivate() {}  
+  OptsPrivate() : mask(0), text(0) {}  
 
-  OptsPrivate(const OptsPrivate& opts) : options(opts.options) {}
+  OptsPrivate(const OptsPrivate& opts) : mask(0), text(0)
+  {
+    unite(opts);
+  }
 
   OptsPrivate& operator=(const OptsPrivate& opts)
   {
-    options = QHash<QString,QVariant>(opts.options);  
+    mask = 0;
+    text = 0;
+    unite(opts);
+    return *this;
   }
   
-  template<typename T> void set(QString opt,const T& value)
-  {
-    options.insert(opt,QVariant(value));
-  }
+  void set(OptId opt,int value) { values[opt].i = value; mask |= bit(opt); }
+  void set(OptId opt,bool value) { values[opt].i = value ? 1 : 0; mask |= bit(opt); }
+  void set(OptId opt,float value) { values[opt].f = value; mask |= bit(opt); }
+
+  // the string is not copied, see Opts::toolTip() for its lifetime
+  void set(OptId opt,const char* value) { assert(optInfo[opt].type==OptTypeString); text = value; mask |= bit(opt); }
  
-  template<typename T> T get(QString opt) const
+  template<typename T> T get(OptId opt) const
   {
-    assert(options.contains(opt));    
-    QVariant optValue = options.value(opt);    
-    assert(optValue.canConvert<T>());
-    return optValue.value<T>();
+    assert(isSet(opt));    
+    return optValue<T>(values[opt]);
   }
 
-  template<typename T> T get(QString opt,const T& defaultValue) const
+  template<typename T> T get(OptId opt,const T& defaultValue) const
   {
-    if (options.contains(opt))
-    {
-      QVariant optValue = options.value(opt);      
-      assert(optValue.canConvert<T>());
-      return optValue.value<T>();
-    }    
+    if (isSet(opt)) return optValue<T>(values[opt]);
     return defaultValue;
   }
+
+  const char* getText() const
+  {
+    return text;
+  }
   
-  bool isSet(const char* opt) const
+  bool isSet(OptId opt) const
   {
-    return options.contains(opt);
+    return (mask & bit(opt))!=0;
   }
   
+  // options set in opts override the ones set here
   void unite(const OptsPrivate& opts)
   {
-    options.unite(opts.options);
+    quint64 m = opts.mask;
+    
+    for(int i=0;m!=0;i++,m>>=1)
+    {
+      if (m & 1) values[i] = opts.values[i];
+    }
+    
+    if (opts.text!=0) text = opts.text;
+    
+    mask |= opts.mask;
+  }
+
+  static quint64 bit(OptId opt)
+  {
+    return ((quint64)1) << opt;
   }
   
-  QHash<QString,QVariant> options;
+  quint64 mask;
+  const char* text;
+  OptValue values[OptCount];
 };
 
-void applyOpts(QObject* obj,const OptsPrivate& opts)
+// compile time checks, OptsPrivate has to fit into Opts::storage and all OptIds into the mask
+typedef char OptsStorageCheck[sizeof(OptsPrivate)<=Opts::StorageSize ? 1 : -1];
+typedef char OptsMaskCheck[OptCount<=64 ? 1 : -1];
+
+QVariant optVariant(const OptsPrivate& opts,OptId opt)
+{
+  switch(optInfo[opt].type)
+  {
+    case OptTypeInt:        return QVariant(opts.get<int>(opt));
+    case OptTypeBool:       return QVariant(opts.get<bool>(opt));
+    case OptTypeFloat:      return QVariant(opts.get<float>(opt));
+    case OptTypeSizePolicy: return QVariant(QSizePolicy((QSizePolicy::Policy)(opts.get<int>(opt) & 0xFF),
+                                                        (QSizePolicy::Policy)(opts.get<int>(opt) >> 8)));
+    case OptTypeCursor:     return QVariant(QCursor((Qt::CursorShape)opts.get<int>(opt)));
+    case OptTypeString:     return QVariant(QString(opts.getText()));
+  }
+  return QVariant();
+}
+
+GuiStats frameStats;
+GuiStats lastFrameStats;
+
+// FNV-1a over size bytes, continuing from hash
+uint hashBytes(uint hash,const void* data,int size)
+{
+  for(int i=0;i<size;i++) hash = (hash ^ ((const uchar*)data)[i]) * 16777619u;
+  return hash;
+}
+
+const uint HashSeed = 2166136261u;
+
+uint hashText(const char* text)
 {
-  QStringList ignoreOpts;
-  ignoreOpts << "align";
-  ignoreOpts << "stretch";
-  ignoreOpts << "gridRow" << "gridColumn" << "gridRowSpan" << "gridColumnSpan";
-  ignoreOpts << "marginLeft" << "marginTop" << "marginRight" << "marginBottom";
-  ignoreOpts << "floatSingleStep" << "floatPageStep";
-  ignoreOpts << "showFrame" << "showTitleBar" << "showMinimizeButton" << "showMaximizeButton" << "showCloseButton" << "showSystemMenu" << "stayOnTop";
-  ignoreOpts << "initialGeometryX" << "initialGeometryY" << "initialGeometryWidth" << "initialGeometryHeight";
-  ignoreOpts << "modal";
+  if (text==0) return 0;
+  
+  return hashBytes(HashSeed,text,(int)strlen(text));
+}
 
-  QHashIterator<QString,QVariant> it(opts.options);
+// Shadow copy of a value last pushed to a widget. Small values are kept as they are, strings and arrays
+// belong to the caller and are remembered by length and hash.
+struct Shadow
+{
+  enum { InlineSize = 16 };
+  
+  Shadow() : length(-1), hash(0) {}
+  
+  int length;
+  uint hash;
+  uchar bytes[InlineSize];
+};
 
-  while (it.hasNext()) 
+// Takes over the new value, false (a suppressed setter) when it equals the shadowed one.
+bool shadowChanged(Shadow& shadow,int length,uint hash)
+{
+  if (length==shadow.length && hash==shadow.hash)
   {
-    it.next();
-    
-    QString opt = it.key();
+    frameStats.settersSuppressed++;
+    return false;
+  }
+  
+  shadow.length = length;
+  shadow.hash = hash;
+  
+  return true;
+}
+
+bool shadowChanged(Shadow& shadow,const char* text)
+{
+  int length = (int)strlen(text);
+  
+  return shadowChanged(shadow,length,hashBytes(HashSeed,text,length));
+}
+
+// scalars and small arrays are compared exactly
+bool shadowChanged(Shadow& shadow,const void* data,int size)
+{
+  if (size>Shadow::InlineSize) return shadowChanged(shadow,size,hashBytes(HashSeed,data,size));
+  
+  if (size==shadow.length && memcmp(shadow.bytes,data,size)==0)
+  {
+    frameStats.settersSuppressed++;
+    return false;
+  }
+  
+  shadow.length = size;
+  memcpy(shadow.bytes,data,size);
+  
+  return true;
+}
+
+bool shadowChanged(Shadow& shadow,int count,char** texts)
+{
+  uint hash = HashSeed;
+  
+  for(int i=0;i<count;i++)
+  {
+    hash = hashBytes(hash,texts[i],(int)strlen(texts[i]));
+    hash *= 16777619u; // separator
+  }
+  
+  return shadowChanged(shadow,count,hash);
+}
+
+// Options and values that were last written to an object, the text option is remembered only by its hash
+// because the string itself belongs to the caller.
+struct AppliedOpts
+{
+  AppliedOpts() : textHash(0) {}
+  
+  OptsPrivate opts;
+  uint textHash;
+  
+  Shadow text;
+  Shadow icon;
+  Shadow items;
+  Shadow range;
+  Shadow value;
+  Shadow window;  // flags and modality
+};
+
+// For every class, index of the Qt property that corresponds to each OptId (-1 if there is none),
+// resolved on the first applyOpts call for that class.
+QHash<const QMetaObject*,QVector<int> > optPropertyIndices;
+
+const QVector<int>& propertyIndices(const QMetaObject* metaObject)
+{
+  QHash<const QMetaObject*,QVector<int> >::iterator it = optPropertyIndices.find(metaObject);
+  
+  if (it!=optPropertyIndices.end()) return it.value();
+  
+  QVector<int> indices(OptCount,-1);
+  
+  for(int i=0;i<OptCount;i++)
+  {
+    if (optInfo[i].property!=0) indices[i] = metaObject->indexOfProperty(optInfo[i].property);
+  }
+  
+  optPropertyIndices.insert(metaObject,indices);
+  
+  return optPropertyIndices[metaObject];
+}
+
+// For every class, value of each option property and of the slider page step on a freshly constructed
+// instance, used to strip the options of a widget that goes back to its pool.
+struct ClassDefaults
+{
+  QVector<QVariant> opts;
+  int pageStep;
+};
+
+QHash<const QMetaObject*,ClassDefaults> optDefaults;
+
+// Called for every widget before its options are applied, the first instance of a class is always a new one.
+void captureOptDefaults(QWidget* widget)
+{
+  const QMetaObject* metaObject = widget->metaObject();
+  
+  if (optDefaults.contains(metaObject)) return;
+  
+  ClassDefaults& defaults = optDefaults[metaObject];
+  const QVector<int>& indices = propertyIndices(metaObject);
+  
+  defaults.opts.resize(OptCount);
+  
+  for(int i=0;i<OptCount;i++)
+  {
+    if (indices[i]!=-1) defaults.opts[i] = metaObject->property(indices[i]).read(widget);
+  }
+  
+  QAbstractSlider* slider = qobject_cast<QAbstractSlider*>(widget);
+  defaults.pageStep = (slider!=0) ? slider->pageStep() : 0;
+}
+
+bool optChanged(const OptsPrivate& opts,const AppliedOpts& applied,uint textHash,OptId opt)
+{
+  if (!applied.opts.isSet(opt)) return true;
+  if (optInfo[opt].type==OptTypeString) return textHash!=applied.textHash;
+  return opts.values[opt].i!=applied.opts.values[opt].i;
+}
+
+// Writes only the options that differ from the ones applied to obj last time.
+void applyOpts(QObject* obj,AppliedOpts& applied,const OptsPrivate& opts)
+{
+  
+  uint textHash = opts.isSet(OptToolTip) ? hashText(opts.getText()) : 0;
+  
+  const QVector<int>& indices = propertyIndices(obj->metaObject());
+  
+  quint64 m = opts.mask;
+
+  for(int i=0;m!=0;i++,m>>=1)
+  {
+    if ((m & 1)==0) continue;
     
-    if (ignoreOpts.contains(opt)) continue;
+    if (optInfo[i].property==0) continue;
     
-    QVariant value = it.value();
+    if (!optChanged(opts,applied,textHash,(OptId)i))
+    {
+      frameStats.optsSkipped++;
+      continue;
+    }
     
-    if (obj->metaObject()->indexOfProperty(qPrintable(opt))!=-1)
+    if (indices[i]!=-1)
     {
-      obj->setProperty(qPrintable(opt),value);           
+      obj->metaObject()->property(indices[i]).write(obj,optVariant(opts,(OptId)i));
+      frameStats.optsApplied++;
     }
     else
     {
-      qWarning("Warning: invalid option \"%s\"!",qPrintable(opt));
+      qWarning("Warning: invalid option \"%s\"!",optInfo[i].property);
     }
   }
   
-  if (opts.isSet("marginLeft") && 
-      opts.isSet("marginTop") && 
-      opts.isSet("marginRight") && 
-      opts.isSet("marginBottom"))
+  if (opts.isSet(OptMarginLeft) && 
+      opts.isSet(OptMarginTop) && 
+      opts.isSet(OptMarginRight) && 
+      opts.isSet(OptMarginBottom))
   {
-    if (QLayout* layout = qobject_cast<QLayout*>(obj)) 
+    if (optChanged(opts,applied,textHash,OptMarginLeft) ||
+        optChanged(opts,applied,textHash,OptMarginTop) ||
+        optChanged(opts,applied,textHash,OptMarginRight) ||
+        optChanged(opts,applied,textHash,OptMarginBottom))
     {
-      layout->setContentsMargins(opts.get<int>("marginLeft"),
-                                 opts.get<int>("marginTop"),
-                                 opts.get<int>("marginRight"),
-                                 opts.get<int>("marginBottom"));
+      if (QLayout* layout = qobject_cast<QLayout*>(obj)) 
+      {
+        layout->setContentsMargins(opts.get<int>(OptMarginLeft),
+                                   opts.get<int>(OptMarginTop),
+                                   opts.get<int>(OptMarginRight),
+                                   opts.get<int>(OptMarginBottom));
+      }
+      else if (QWidget* widget = qobject_cast<QWidget*>(obj))
+      {
+        widget->setContentsMargins(opts.get<int>(OptMarginLeft),
+                                   opts.get<int>(OptMarginTop),
+                                   opts.get<int>(OptMarginRight),
+                                   opts.get<int>(OptMarginBottom));
+      }
+      else
+      {
+        qWarning("applyOpts FAIL!");
+      }
+      frameStats.optsApplied++;
     }
-    else if (QWidget* widget = qobject_cast<QWidget*>(obj))
+    else
     {
-      widget->setContentsMargins(opts.get<int>("marginLeft"),
-                                 opts.get<int>("marginTop"),
-                                 opts.get<int>("marginRight"),
-                                 opts.get<int>("marginBottom"));
+      frameStats.optsSkipped++;
     }
-    else
+  }
+  
+  // options that were not passed this time keep their last value, just like the Qt properties do
+  applied.opts.unite(opts);
+  if (opts.isSet(OptToolTip)) applied.textHash = textHash;
+}
+
+// Writes back the class defaults of all properties set through applyOpts.
+void resetOpts(QWidget* widget,const AppliedOpts& applied)
+{
+  QHash<const QMetaObject*,ClassDefaults>::const_iterator defaults = optDefaults.constFind(widget->metaObject());
+  
+  if (defaults==optDefaults.constEnd()) return;
+  
+  const QVector<int>& indices = propertyIndices(widget->metaObject());
+  const QVector<QVariant>& values = defaults.value().opts;
+  
+  quint64 m = applied.opts.mask;
+  
+  for(int i=0;m!=0;i++,m>>=1)
+  {
+    if ((m & 1)==0) continue;
+    
+    if (indices[i]!=-1 && values[i].isValid())
     {
-      qWarning("applyOpts FAIL!");
-    }    
-  }      
+      widget->metaObject()->property(indices[i]).write(widget,values[i]);
+    }
+  }
+  
+  if (applied.opts.isSet(OptMarginLeft)) widget->setContentsMargins(0,0,0,0);
+  
+  // the float sliders write the page step directly
+  if (QAbstractSlider* slider = qobject_cast<QAbstractSlider*>(widget)) slider->setPageStep(defaults.value().pageStep);
 }
 
 Opts::Opts()
 {
-  opts = new OptsPrivate(); 
+  opts = new (&storage) OptsPrivate(); 
 }
 
 Opts::~Opts()
 { 
-  delete opts; 
+  opts->~OptsPrivate(); 
 }
 
 Opts::Opts(const Opts& other)
 { 
-  opts = new OptsPrivate(*other.opts); 
+  opts = new (&storage) OptsPrivate(*other.opts); 
 }
 
 Opts::Opts(const Opts& other0,const Opts& other1)
 { 
-  opts = new OptsPrivate(*other0.opts); 
+  opts = new (&storage) OptsPrivate(*other0.opts); 
   opts->unite(*other1.opts);
 }
 
 Opts::Opts(const Opts& other0,const Opts& other1,const Opts& other2)
 { 
-  opts = new OptsPrivate(*other0.opts);
+  opts = new (&storage) OptsPrivate(*other0.opts);
   opts->unite(*other1.opts);
   opts->unite(*other2.opts);
 }
 
 Opts::Opts(const Opts& other0,const Opts& other1,const Opts& other2,const Opts& other3)
 { 
-  opts = new OptsPrivate(*other0.opts); 
+  opts = new (&storage) OptsPrivate(*other0.opts); 
   opts->unite(*other1.opts);
   opts->unite(*other2.opts);
   opts->unite(*other3.opts);
@@ -194,7 +595,7 @@ Opts::Opts(const Opts& other0,const Opts& other1,const Opts& other2,const Opts&
 
 Opts::Opts(const Opts& other0,const Opts& other1,const Opts& other2,const Opts& other3,const Opts& other4)
 { 
-  opts = new OptsPrivate(*other0.opts); 
+  opts = new (&storage) OptsPrivate(*other0.opts); 
   opts->unite(*other1.opts);
   opts->unite(*other2.opts);
   opts->unite(*other3.opts);
@@ -205,43 +606,42 @@ Opts& Opts::operator=(const Opts& other)
 { 
   if (this != &other)
   {
-    delete opts;
-    opts = new OptsPrivate(*other.opts);  
+    *opts = *other.opts;  
   }  
   return *this;
 }
 
-Opts& Opts::align(int alignFlags) { opts->set("align",(Qt::Alignment)alignFlags); return *this; }
+Opts& Opts::align(int alignFlags) { opts->set(OptAlign,alignFlags); return *this; }
 
-Opts& Opts::stretch(int stretch) { opts->set("stretch",stretch); return *this; }
+Opts& Opts::stretch(int stretch) { opts->set(OptStretch,stretch); return *this; }
 
 Opts& Opts::cell(int row,int column)
 { 
-  opts->set("gridRow",row); 
-  opts->set("gridColumn",column); 
+  opts->set(OptGridRow,row); 
+  opts->set(OptGridColumn,column); 
     
   return *this;
 }
 
 Opts& Opts::span(int rowSpan,int columnSpan)
 { 
-  opts->set("gridRowSpan",rowSpan); 
-  opts->set("gridColumnSpan",columnSpan); 
+  opts->set(OptGridRowSpan,rowSpan); 
+  opts->set(OptGridColumnSpan,columnSpan); 
   return *this;
 }
 
 Opts& Opts::sizePolicy(SizePolicy horizontal,SizePolicy vertical) 
 { 
-  opts->set("sizePolicy",QSizePolicy((QSizePolicy::Policy)horizontal,(QSizePolicy::Policy)vertical)); 
+  opts->set(OptSizePolicy,(int)horizontal | ((int)vertical << 8)); 
   return *this; 
 }
 
-Opts& Opts::minimumWidth(int width) { opts->set("minimumWidth",width); return *this; }
-Opts& Opts::minimumHeight(int height) { opts->set("minimumHeight",height); return *this; }
+Opts& Opts::minimumWidth(int width) { opts->set(OptMinimumWidth,width); return *this; }
+Opts& Opts::minimumHeight(int height) { opts->set(OptMinimumHeight,height); return *this; }
 Opts& Opts::minimumSize(int width,int height) { minimumWidth(width); minimumHeight(height); return *this; }
 
-Opts& Opts::maximumWidth(int width) { opts->set("maximumWidth",width); return *this; }
-Opts& Opts::maximumHeight(int height) { opts->set("maximumHeight",height); return *this; }
+Opts& Opts::maximumWidth(int width) { opts->set(OptMaximumWidth,width); return *this; }
+Opts& Opts::maximumHeight(int height) { opts->set(OptMaximumHeight,height); return *this; }
 Opts& Opts::maximumSize(int width,int height) { maximumWidth(width); maximumHeight(height); return *this; }
 
 Opts& Opts::fixedWidth(int width) { minimumWidth(width); maximumWidth(width); return *this; }
@@ -250,74 +650,79 @@ Opts& Opts::fixedSize(int width,int height) { fixedWidth(width); fixedHeight(hei
 
 Opts& Opts::initialGeometry(int x,int y,int width,int height)
 {
-  opts->set("initialGeometryX",x); 
-  opts->set("initialGeometryY",y); 
-  opts->set("initialGeometryWidth",width); 
-  opts->set("initialGeometryHeight",height); 
+  opts->set(OptInitialGeometryX,x); 
+  opts->set(OptInitialGeometryY,y); 
+  opts->set(OptInitialGeometryWidth,width); 
+  opts->set(OptInitialGeometryHeight,height); 
   return *this; 
 }
 
 Opts& Opts::margins(int left,int top,int right,int bottom)
 { 
-  opts->set("marginLeft",left); 
-  opts->set("marginTop",top); 
-  opts->set("marginRight",right); 
-  opts->set("marginBottom",bottom); 
+  opts->set(OptMarginLeft,left); 
+  opts->set(OptMarginTop,top); 
+  opts->set(OptMarginRight,right); 
+  opts->set(OptMarginBottom,bottom); 
   return *this;
 }
 
-Opts& Opts::enabled(bool enabled) { opts->set("enabled",enabled); return *this; }
+Opts& Opts::enabled(bool enabled) { opts->set(OptEnabled,enabled); return *this; }
 
-Opts& Opts::cursor(CursorShape cursor) { opts->set("cursor",QCursor((Qt::CursorShape)cursor)); return *this; }
+Opts& Opts::cursor(CursorShape cursor) { opts->set(OptCursor,(int)cursor); return *this; }
 
-Opts& Opts::focusPolicy(FocusPolicy policy) { opts->set("focusPolicy",(Qt::FocusPolicy)policy); return *this; }
+Opts& Opts::focusPolicy(FocusPolicy policy) { opts->set(OptFocusPolicy,(int)policy); return *this; }
 
-Opts& Opts::toolTip(char* text) { opts->set("toolTip",text); return *this; }
+Opts& Opts::toolTip(char* text) { opts->set(OptToolTip,(const char*)text); return *this; }
 
-Opts& Opts::alignText(int alignFlags) { opts->set("alignment",(Qt::Alignment)alignFlags); return *this; }
+Opts& Opts::alignText(int alignFlags) { opts->set(OptAlignText,alignFlags); return *this; }
 
-Opts& Opts::readOnly(bool readOnly) { opts->set("readOnly",readOnly); return *this; }
+Opts& Opts::readOnly(bool readOnly) { opts->set(OptReadOnly,readOnly); return *this; }
 
-Opts& Opts::tracking(bool tracking) { opts->set("tracking",tracking); return *this; }
-Opts& Opts::singleStep(int step) { opts->set("singleStep",step); return *this; }
-Opts& Opts::pageStep(int step) { opts->set("pageStep",step); return *this; }
+Opts& Opts::tracking(bool tracking) { opts->set(OptTracking,tracking); return *this; }
+Opts& Opts::singleStep(int step) { opts->set(OptSingleStep,step); return *this; }
+Opts& Opts::pageStep(int step) { opts->set(OptPageStep,step); return *this; }
 
-Opts& Opts::singleStep(float step) { opts->set("floatSingleStep",step); return *this; }
-Opts& Opts::pageStep(float step) { opts->set("floatPageStep",step); return *this; }
+Opts& Opts::singleStep(float step) { opts->set(OptFloatSingleStep,step); return *this; }
+Opts& Opts::pageStep(float step) { opts->set(OptFloatPageStep,step); return *this; }
 
-Opts& Opts::tickInterval(int interval) { opts->set("tickInterval",interval); return *this; }
-Opts& Opts::tickPosition(SliderTicks ticks) { opts->set("tickPosition",(QSlider::TickPosition)ticks); return *this; }
+Opts& Opts::tickInterval(int interval) { opts->set(OptTickInterval,interval); return *this; }
+Opts& Opts::tickPosition(SliderTicks ticks) { opts->set(OptTickPosition,(int)ticks); return *this; }
+Opts& Opts::orientation(Orientation orientation) { opts->set(OptOrientation,(int)orientation); return *this; }
 
-Opts& Opts::keyboardTracking(bool tracking) { opts->set("keyboardTracking",tracking); return *this; }
-Opts& Opts::decimals(int decimals) { opts->set("decimals",decimals); return *this; }
+Opts& Opts::keyboardTracking(bool tracking) { opts->set(OptKeyboardTracking,tracking); return *this; }
+Opts& Opts::decimals(int decimals) { opts->set(OptDecimals,decimals); return *this; }
 
-Opts& Opts::frameShape(FrameShape shape) { opts->set("frameShape",(QFrame::Shape)shape); return *this; }
-Opts& Opts::frameShadow(FrameShadow shadow) { opts->set("frameShadow",(QFrame::Shadow)shadow); return *this; }
-Opts& Opts::frameLineWidth(int width) { opts->set("lineWidth",width); return *this; }
-Opts& Opts::frameMidLineWidth(int width) { opts->set("midLineWidth",width); return *this; }
+Opts& Opts::frameShape(FrameShape shape) { opts->set(OptFrameShape,(int)shape); return *this; }
+Opts& Opts::frameShadow(FrameShadow shadow) { opts->set(OptFrameShadow,(int)shadow); return *this; }
+Opts& Opts::frameLineWidth(int width) { opts->set(OptFrameLineWidth,width); return *this; }
+Opts& Opts::frameMidLineWidth(int width) { opts->set(OptFrameMidLineWidth,width); return *this; }
 
-Opts& Opts::modal(bool modal) { opts->set("modal",modal); return *this; }
+Opts& Opts::modal(bool modal) { opts->set(OptModal,modal); return *this; }
 
-Opts& Opts::showFrame(bool showFrame) { opts->set("showFrame",showFrame); return *this; }
-Opts& Opts::showTitleBar(bool showTitleBar) { opts->set("showTitleBar",showTitleBar); return *this; }
-Opts& Opts::showMinimizeButton(bool showMinimizeButton) { opts->set("showMinimizeButton",showMinimizeButton); return *this; }
-Opts& Opts::showMaximizeButton(bool showMaximizeButton) { opts->set("showMaximizeButton",showMaximizeButton); return *this; }
+Opts& Opts::showFrame(bool showFrame) { opts->set(OptShowFrame,showFrame); return *this; }
+Opts& Opts::showTitleBar(bool showTitleBar) { opts->set(OptShowTitleBar,showTitleBar); return *this; }
+Opts& Opts::showMinimizeButton(bool showMinimizeButton) { opts->set(OptShowMinimizeButton,showMinimizeButton); return *this; }
+Opts& Opts::showMaximizeButton(bool showMaximizeButton) { opts->set(OptShowMaximizeButton,showMaximizeButton); return *this; }
 Opts& Opts::showMinMaxButtons(bool showMinButton,bool showMaxButton) { showMinimizeButton(showMinButton); showMaximizeButton(showMaxButton); return *this; }
-Opts& Opts::showCloseButton(bool showCloseButton) { opts->set("showCloseButton",showCloseButton); return *this; }
-Opts& Opts::showSystemMenu(bool showSystemMenu) { opts->set("showSystemMenu",showSystemMenu); return *this; }
-Opts& Opts::stayOnTop(bool stayOnTop) { opts->set("stayOnTop",stayOnTop); return *this; }
+Opts& Opts::showCloseButton(bool showCloseButton) { opts->set(OptShowCloseButton,showCloseButton); return *this; }
+Opts& Opts::showSystemMenu(bool showSystemMenu) { opts->set(OptShowSystemMenu,showSystemMenu); return *this; }
+Opts& Opts::stayOnTop(bool stayOnTop) { opts->set(OptStayOnTop,stayOnTop); return *this; }
 
 Opts& Opts::sizeConstraint(SizeConstraint constraint)
 { 
-  opts->set("sizeConstraint",(QLayout::SizeConstraint)constraint); 
+  opts->set(OptSizeConstraint,(int)constraint); 
   return *this; 
 }
 
-Opts& Opts::spacing(int spacing) { opts->set("spacing",spacing); return *this; }
-Opts& Opts::horizontalSpacing(int spacing) { opts->set("horizontalSpacing",spacing); return *this; }
-Opts& Opts::verticalSpacing(int spacing) { opts->set("verticalSpacing",spacing); return *this; }
+Opts& Opts::spacing(int spacing) { opts->set(OptSpacing,spacing); return *this; }
+Opts& Opts::horizontalSpacing(int spacing) { opts->set(OptHorizontalSpacing,spacing); return *this; }
+Opts& Opts::verticalSpacing(int spacing) { opts->set(OptVerticalSpacing,spacing); return *this; }
 Opts& Opts::spacing(int hspacing,int vspacing) { horizontalSpacing(hspacing); verticalSpacing(vspacing); return *this; }
 
+Opts& Opts::zoom(float zoom) { opts->set(OptZoom,zoom); return *this; }
+Opts& Opts::pan(float x,float y) { opts->set(OptPanX,x); opts->set(OptPanY,y); return *this; }
+Opts& Opts::interpolation(Interpolation interpolation) { opts->set(OptInterpolation,(int)interpolation); return *this; }
+
 struct LayoutPosition
 {
   LayoutPosition()
@@ -327,6 +732,8 @@ struct LayoutPosition
     column = -1;
     rowSpan = -1;
     columnSpan = -1;
+    stretch = 0;
+    alignment = 0;
   }
   
   int order;
@@ -335,153 +742,560 @@ struct LayoutPosition
   int column;
   int rowSpan;
   int columnSpan;
+  
+  int stretch;
+  int alignment;
 };
 
 QApplication* app;
-IMEventFilter* eventFilter;
+IMInputCapture* inputCapture;
 
-QHash<int,QWidget*> widgets;
-QHash<int,QLayout*> layouts;
+QVector<IMWidget*> dirtyWidgets;
+QVector<IMWidget*> changedWidgets;
+QElapsedTimer latencyClock;
 
 QStack<QWidget*> widgetStack;
 QStack<QLayout*> layoutStack;
 QStack<int>      orderStack;
+QStack<IMInputState*> inputStack; // input state of the widget at the top of the widgetStack, 0 if it has none
 
-QSet<QObject*> fresh;
-
-QHash<QObject*,QLayout*> parentLayout;
-QHash<QObject*,LayoutPosition> layoutPosition;
-
-QVector<QWidget*> showlist;
-
-bool needsReinsert(QObject* object,QLayout* layout,const OptsPrivate& opts)
+// Bookkeeping record of a widget or layout created by the library.
+struct Node
 {
-  assert(object->inherits("QWidget") || object->inherits("QLayout"));
-  assert(layout->inherits("QBoxLayout") || layout->inherits("QGridLayout"));
-
-  if (layout->inherits("QBoxLayout"))
-  {
-    // pridat kontrolu zmeny stretche a alignmentu
-    if (orderStack.top()!=layoutPosition[object].order) return true;
-  }
-  else if (layout->inherits("QGridLayout"))
+  Node() : uid(0), layout(false), object(0), parentLayout(0), attached(false), generation(0), prev(-1), next(-1), block(0) {}
+  
+  quint64 uid;            // scoped id from scopedId(), a widget and a layout may share it
+  bool layout;
+  QObject* object;        // 0 for free and sentinel nodes
+  
+  QLayout* parentLayout;  // layout the object is inserted in, 0 when it is the top layout of a widget
+  bool attached;          // false while the object is not inserted anywhere (top-level windows, detached objects)
+  LayoutPosition position;
+  
+  // Touching an object during a frame stamps its node with frameGeneration and moves it from the stale list
+  // to the fresh list, so at guiUpdate() the stale lists hold exactly the objects that were not declared this frame.
+  // A skipped cache block moves its runs without stamping them, only their ends, so whether an object was
+  // declared in this frame is asked with declaredThisFrame(), not by comparing the generation.
+  uint generation;
+  int prev;
+  int next;
+  
+  quint64 block;          // uid of the innermost CacheBegin block that declared the object, 0 if none
+  
+  bool isLayout() const
   {
-    int row = opts.get<int>("gridRow",0);
-    int column = opts.get<int>("gridColumn",0);
-    int rowSpan = opts.get<int>("gridRowSpan",1);
-    int columnSpan = opts.get<int>("gridColumnSpan",1);
-
-    // pridat kontrolu zmeny alignmentu
-    if (row!=layoutPosition[object].row) return true;
-    if (column!=layoutPosition[object].column) return true;
-    if (rowSpan!=layoutPosition[object].rowSpan) return true;
-    if (columnSpan!=layoutPosition[object].columnSpan) return true;
+    return layout;
   }
-
-  return false;  
 };
 
-void insertToLayout(QObject* object,QLayout* layout,const OptsPrivate& opts)
-{  
-  assert(object->inherits("QWidget") || object->inherits("QLayout"));
-  assert(layout->inherits("QBoxLayout") || layout->inherits("QGridLayout"));
+// All nodes live in one array and are addressed by index, an open addressing hash (linear probing)
+// maps (uid, isLayout) keys to node indices. The first SentinelCount nodes are the heads of the stale/fresh frame lists,
+// free nodes are chained through their next link.
+class NodeTable
+{
+public:
+  enum
+  {
+    StaleWidgets,
+    FreshWidgets,
+    StaleLayouts,
+    FreshLayouts,
+    SentinelCount
+  };
   
-  if (QBoxLayout* boxLayout = qobject_cast<QBoxLayout*>(layout)) 
+  NodeTable()
   {
-    int order = orderStack.top();
-    int stretch = opts.get<int>("stretch",0);
-    Qt::Alignment alignment = (Qt::Alignment)opts.get<int>("align",0);
+    clear();
+  }
+  
+  void clear()
+  {
+    nodes.clear();
+    applied.clear();
     
-    if (QWidget* widgetItem = qobject_cast<QWidget*>(object))
-    {
-      boxLayout->insertWidget(order,widgetItem,stretch,alignment);      
-    }
-    else if (QLayout* layoutItem = qobject_cast<QLayout*>(object))
+    nodes.resize(SentinelCount);
+    applied.resize(SentinelCount);
+    
+    for(int i=0;i<SentinelCount;i++)
     {
-      boxLayout->insertLayout(order,layoutItem,stretch);      
+      nodes[i].prev = i;
+      nodes[i].next = i;
     }
-
-    // pridat stretch a alignment do layoutPosition zaznamu!!!!
-    layoutPosition[object] = LayoutPosition();
-    layoutPosition[object].order = order;
+    
+    buckets.fill(Empty,16);
+    freeList = -1;
+    count = 0;
+    used = 0;
   }
-  else if (QGridLayout* gridLayout = qobject_cast<QGridLayout*>(layout))
+  
+  int find(quint64 uid,bool isLayout) const
   {
-    /*
-    if (!opts.isSet("gridRow") || !opts.isSet("gridColumn"))
+    int mask = buckets.size()-1;
+    
+    for(int i=hashKey(uid,isLayout) & mask;;i=(i+1) & mask)
     {
-      printf("Error: cell not set!\n");
+      int index = buckets[i];
+      
+      if (index==Empty) return -1;
+      if (index!=Removed && nodes[index].uid==uid && nodes[index].layout==isLayout) return index;
     }
-    */
+  }
+  
+  // Node of an object created by the library, -1 for foreign objects.
+  // Meant for teardown paths only, it goes through the dynamic "id" property.
+  int nodeOf(QObject* object) const
+  {
+    QVariant id = object->property("id");
     
-    int row = opts.get<int>("gridRow",0);
-    int column = opts.get<int>("gridColumn",0);
-    int rowSpan = opts.get<int>("gridRowSpan",1);
-    int columnSpan = opts.get<int>("gridColumnSpan",1);
-    Qt::Alignment alignment = (Qt::Alignment)opts.get<int>("align",0);
+    if (!id.isValid()) return -1;
     
-    if (QWidget* widgetItem = qobject_cast<QWidget*>(object))
+    int index = find(id.toULongLong(),!object->isWidgetType());
+    
+    if (index!=-1 && nodes[index].object!=object) return -1;
+    
+    return index;
+  }
+  
+  // The new node starts detached in the stale list. Invalidates references to other nodes.
+  int insert(quint64 uid,bool isLayout,QObject* object)
+  {
+    assert(find(uid,isLayout)==-1);
+    assert(object!=0);
+    
+    if ((used+1)*4 > buckets.size()*3) rehash(count+1);
+    
+    int index;
+    
+    if (freeList!=-1)
     {
-      gridLayout->addWidget(widgetItem,row,column,rowSpan,columnSpan,alignment);    
+      index = freeList;
+      freeList = nodes[index].next;
+      nodes[index] = Node();
+      applied[index] = AppliedOpts();
     }
-    else if (QLayout* layoutItem = qobject_cast<QLayout*>(object))
+    else
     {
-      gridLayout->addLayout(layoutItem,row,column,rowSpan,columnSpan,alignment);  
+      index = nodes.size();
+      nodes.push_back(Node());
+      applied.push_back(AppliedOpts());
     }
-
-    // pridat alignment do layoutPosition zaznamu!!!!
-    layoutPosition[object] = LayoutPosition();
-    layoutPosition[object].row = row;
-    layoutPosition[object].column = column;
-    layoutPosition[object].rowSpan = rowSpan;
-    layoutPosition[object].columnSpan = columnSpan;
+    
+    nodes[index].uid = uid;
+    nodes[index].layout = isLayout;
+    nodes[index].object = object;
+    nodes[index].prev = index;
+    nodes[index].next = index;
+    link(index,isLayout ? StaleLayouts : StaleWidgets);
+    
+    int mask = buckets.size()-1;
+    int i = hashKey(nodes[index].uid,nodes[index].layout) & mask;
+    
+    while (buckets[i]>=0) i = (i+1) & mask;
+    
+    if (buckets[i]==Empty) used++;
+    buckets[i] = index;
+    count++;
+    
+    return index;
   }
   
-  //parentLayout[object] = layout;
-}
+  void remove(int index)
+  {
+    assert(index>=SentinelCount && nodes[index].object!=0);
+    
+    int mask = buckets.size()-1;
+    int i = hashKey(nodes[index].uid,nodes[index].layout) & mask;
+    
+    while (buckets[i]!=index) i = (i+1) & mask;
+    
+    buckets[i] = Removed;
+    count--;
+    
+    unlink(index);
+    
+    nodes[index].object = 0;
+    nodes[index].next = freeList;
+    freeList = index;
+  }
+  
+  Node& operator[](int index)
+  {
+    return nodes[index];
+  }
+  
+  AppliedOpts& appliedOpts(int index)
+  {
+    return applied[index];
+  }
+  
+  int size() const
+  {
+    return count;
+  }
 
-void reparentWidget(QWidget* widget,const OptsPrivate& opts)
-{ 
-  assert(layoutStack.top()!=0);
+  bool isEmpty(int list) const
+  {
+    return nodes[list].next==list;
+  }
   
-  if (parentLayout[widget] != layoutStack.top())
+  int first(int list) const
   {
-    qDebug("reparenting widget %s",qPrintable(widget->objectName()));
+    return nodes[list].next;
+  }
+  
+  int last(int list) const
+  {
+    return nodes[list].prev;
+  }
+  
+  void unlink(int index)
+  {
+    Node& node = nodes[index];
     
-    if (parentLayout[widget]!=((QLayout*)-1)) parentLayout[widget]->removeWidget(widget);        
-    widget->setParent(0); //According to Qt documentation, this shouldn't be necessary, "The layout will automatically reparent the widgets (using QWidget::setParent()) so that they are children of the widget on which the layout is installed"
-    parentLayout[widget] = (QLayout*)-1;
-           
-    insertToLayout(widget,layoutStack.top(),opts);
-    parentLayout[widget] = layoutStack.top();
+    nodes[node.prev].next = node.next;
+    nodes[node.next].prev = node.prev;
+    node.prev = index;
+    node.next = index;
   }
-}
-
-// Widgets that are inside VBox or HBox layout must appear in the same order in which their respective functions are called.
-// If this ordering changed from the last call to update() then each affected widget must be reinserted to it's parentLayout at correct index
-// given by the value at the top of the orderStack.
-void reinsertWidget(QWidget* widget,const OptsPrivate& opts)
-{
-  assert(parentLayout[widget]!=0); 
-  assert(parentLayout[widget]!=(QLayout*)-1);
   
-  if (needsReinsert(widget,parentLayout[widget],opts))
+  // appends the node at the end of list
+  void link(int index,int list)
   {
-    qDebug("reinserting widget %s",qPrintable(widget->objectName()));
-    parentLayout[widget]->removeWidget(widget);    
-    insertToLayout(widget,parentLayout[widget],opts);
+    Node& node = nodes[index];
+    
+    node.prev = nodes[list].prev;
+    node.next = list;
+    nodes[nodes[list].prev].next = index;
+    nodes[list].prev = index;
   }
-}
-
-void deleteLayout(QLayout* layout)
-{
-  qDebug("deleting layout %s",qPrintable(layout->objectName()));fflush(stdout);
   
-  // QLayout si udrzuje reference na svoje sub-layouty jako potomky pomoci children mechanizmu QObjectu.
-  // V momente kdy smazu layout, smaze jeho destruktor i vsechny svoje children sub-layouty,
-  // a rekurzivne se tak smaze celej podstrom layoutuu zakorenenej v tomhle layoutu.
-  //
-  // To je sice pekny, ale ja se tohohle chovani potrebuju zbavit, protoze si chci vsechny vytvoreny layouty
+  // moves the run of linked nodes first..last to the end of list
+  void moveRun(int first,int last,int list)
+  {
+    nodes[nodes[first].prev].next = nodes[last].next;
+    nodes[nodes[last].next].prev = nodes[first].prev;
+    
+    nodes[first].prev = nodes[list].prev;
+    nodes[last].next = list;
+    nodes[nodes[list].prev].next = first;
+    nodes[list].prev = last;
+  }
+  
+  // moves all nodes of list "from" to the end of list "to"
+  void splice(int to,int from)
+  {
+    if (isEmpty(from)) return;
+    
+    int first = nodes[from].next;
+    int last = nodes[from].prev;
+    
+    nodes[first].prev = nodes[to].prev;
+    nodes[last].next = to;
+    nodes[nodes[to].prev].next = first;
+    nodes[to].prev = last;
+    
+    nodes[from].prev = from;
+    nodes[from].next = from;
+  }
+  
+private:
+  enum
+  {
+    Empty = -1,
+    Removed = -2
+  };
+  
+  static uint hashKey(quint64 key,bool isLayout)
+  {
+    if (isLayout) key = ~key;
+    
+    key ^= key >> 33;
+    key *= Q_UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    return (uint)key;
+  }
+  
+  // rebuilds the index without tombstones, sized for at most 50% load
+  void rehash(int minCount)
+  {
+    int capacity = 16;
+    while (capacity < minCount*2) capacity *= 2;
+    
+    buckets.fill(Empty,capacity);
+    used = 0;
+    
+    int mask = capacity-1;
+    
+    for(int index=SentinelCount;index<nodes.size();index++)
+    {
+      if (nodes[index].object==0) continue;
+      
+      int i = hashKey(nodes[index].uid,nodes[index].layout) & mask;
+      while (buckets[i]!=Empty) i = (i+1) & mask;
+      buckets[i] = index;
+      used++;
+    }
+  }
+  
+  QVector<Node> nodes;
+  QVector<AppliedOpts> applied; // cold data, kept apart from the nodes
+  QVector<int> buckets;
+  int freeList;
+  int count;
+  int used;
+};
+
+uint frameGeneration = 1;
+
+NodeTable nodeTable;
+
+// Seeds of the id scopes opened by PushID(), WindowBegin() and GroupBoxBegin().
+// Ids declared outside of any scope are used as they are.
+QStack<quint64> idStack;
+
+quint64 mixId(quint64 seed,quint64 value)
+{
+  quint64 h = seed ^ (value + Q_UINT64_C(0x9e3779b97f4a7c15) + (seed << 6) + (seed >> 2));
+  
+  h ^= h >> 33;
+  h *= Q_UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  
+  return h;
+}
+
+quint64 scopedId(int id)
+{
+  return idStack.isEmpty() ? (quint64)(uint)id : mixId(idStack.top(),(uint)id);
+}
+
+// Hidden widgets that vanished from the frame, ready to be handed to the next widget of the same class.
+// Only classes whose creation path asks recycledWidget<T>() get a pool.
+QHash<const QMetaObject*,QVector<QWidget*> > widgetPools;
+int widgetPoolCapacity = 256;
+
+template<typename T> T* recycledWidget()
+{
+  QVector<QWidget*>& pool = widgetPools[&T::staticMetaObject];
+  
+  if (pool.isEmpty())
+  {
+    frameStats.poolMisses++;
+    return 0;
+  }
+  
+  frameStats.poolHits++;
+  
+  T* widget = (T*)pool.back();
+  pool.pop_back();
+  
+  return widget;
+}
+
+// Detaches a vanished widget into its pool instead of deleting it, false when the class has no pool or it is full.
+bool recycleWidget(int index)
+{
+  QWidget* widget = (QWidget*)nodeTable[index].object;
+  
+  QHash<const QMetaObject*,QVector<QWidget*> >::iterator pool = widgetPools.find(widget->metaObject());
+  
+  if (pool==widgetPools.end() || pool.value().size()>=widgetPoolCapacity) return false;
+  
+  Node& node = nodeTable[index];
+  
+  if (node.attached) node.parentLayout->removeWidget(widget);
+  
+  widget->clearFocus();
+  widget->setParent(0);
+  
+  resetOpts(widget,nodeTable.appliedOpts(index));
+  
+  if (IMWidget* imWidget = dynamic_cast<IMWidget*>(widget)) imWidget->node = -1;
+  
+  // icons are set only when passed, don't hand them over to the next owner
+  if (QAbstractButton* button = qobject_cast<QAbstractButton*>(widget))
+  {
+    if (!button->icon().isNull()) button->setIcon(QIcon());
+  }
+  
+  nodeTable.remove(index);
+  
+  pool.value().push_back(widget);
+  
+  return true;
+}
+
+void clearWidgetPools(int capacity)
+{
+  QHash<const QMetaObject*,QVector<QWidget*> >::iterator it;
+  
+  for(it=widgetPools.begin();it!=widgetPools.end();++it)
+  {
+    QVector<QWidget*>& pool = it.value();
+    
+    while (pool.size()>capacity)
+    {
+      delete pool.back();
+      pool.pop_back();
+    }
+  }
+}
+
+QVector<QWidget*> showlist;
+
+// Windows declared during the frame, their top layouts stay disabled until activateLayouts().
+QVector<QWidget*> touchedWindows;
+
+bool needsReinsert(const Node& node,QLayout* layout,const OptsPrivate& opts)
+{
+  assert(node.object->inherits("QWidget") || node.object->inherits("QLayout"));
+  assert(layout->inherits("QBoxLayout") || layout->inherits("QGridLayout"));
+
+  // changes of order inside a box layout are resolved at once by arrangeBoxLayout()
+  if (layout->inherits("QBoxLayout"))
+  {
+    int stretch = opts.get<int>(OptStretch,0);
+    int alignment = opts.get<int>(OptAlign,0);
+    
+    if (stretch!=node.position.stretch) return true;
+    if (alignment!=node.position.alignment) return true;
+  }
+  else if (layout->inherits("QGridLayout"))
+  {
+    int row = opts.get<int>(OptGridRow,0);
+    int column = opts.get<int>(OptGridColumn,0);
+    int rowSpan = opts.get<int>(OptGridRowSpan,1);
+    int columnSpan = opts.get<int>(OptGridColumnSpan,1);
+    int alignment = opts.get<int>(OptAlign,0);
+
+    if (alignment!=node.position.alignment) return true;
+    if (row!=node.position.row) return true;
+    if (column!=node.position.column) return true;
+    if (rowSpan!=node.position.rowSpan) return true;
+    if (columnSpan!=node.position.columnSpan) return true;
+  }
+
+  return false;  
+};
+
+void insertToLayout(int index,QLayout* layout,const OptsPrivate& opts)
+{  
+  Node& node = nodeTable[index];
+  QObject* object = node.object;
+  
+  assert(object->inherits("QWidget") || object->inherits("QLayout"));
+  assert(layout->inherits("QBoxLayout") || layout->inherits("QGridLayout"));
+  
+  if (QBoxLayout* boxLayout = qobject_cast<QBoxLayout*>(layout)) 
+  {
+    int order = orderStack.top();
+    int stretch = opts.get<int>(OptStretch,0);
+    Qt::Alignment alignment = (Qt::Alignment)opts.get<int>(OptAlign,0);
+    
+    if (QWidget* widgetItem = qobject_cast<QWidget*>(object))
+    {
+      boxLayout->insertWidget(order,widgetItem,stretch,alignment);      
+    }
+    else if (QLayout* layoutItem = qobject_cast<QLayout*>(object))
+    {
+      boxLayout->insertLayout(order,layoutItem,stretch);      
+    }
+
+    node.position = LayoutPosition();
+    node.position.order = order;
+    node.position.stretch = stretch;
+    node.position.alignment = alignment;
+  }
+  else if (QGridLayout* gridLayout = qobject_cast<QGridLayout*>(layout))
+  {
+    /*
+    if (!opts.isSet(OptGridRow) || !opts.isSet(OptGridColumn))
+    {
+      printf("Error: cell not set!\n");
+    }
+    */
+    
+    int row = opts.get<int>(OptGridRow,0);
+    int column = opts.get<int>(OptGridColumn,0);
+    int rowSpan = opts.get<int>(OptGridRowSpan,1);
+    int columnSpan = opts.get<int>(OptGridColumnSpan,1);
+    Qt::Alignment alignment = (Qt::Alignment)opts.get<int>(OptAlign,0);
+    
+    if (QWidget* widgetItem = qobject_cast<QWidget*>(object))
+    {
+      gridLayout->addWidget(widgetItem,row,column,rowSpan,columnSpan,alignment);    
+    }
+    else if (QLayout* layoutItem = qobject_cast<QLayout*>(object))
+    {
+      gridLayout->addLayout(layoutItem,row,column,rowSpan,columnSpan,alignment);  
+    }
+
+    node.position = LayoutPosition();
+    node.position.row = row;
+    node.position.column = column;
+    node.position.rowSpan = rowSpan;
+    node.position.columnSpan = columnSpan;
+    node.position.alignment = alignment;
+  }
+  
+  //parentLayout[object] = layout;
+  node.parentLayout = layout;
+  node.attached = true;
+}
+
+void reparentWidget(int index,const OptsPrivate& opts)
+{ 
+  assert(layoutStack.top()!=0);
+  
+  Node& node = nodeTable[index];
+  
+  if (!node.attached || node.parentLayout!=layoutStack.top())
+  {
+    QWidget* widget = (QWidget*)node.object;
+    
+    qDebug("reparenting widget %s",qPrintable(widget->objectName()));
+    
+    if (node.attached) node.parentLayout->removeWidget(widget);        
+    widget->setParent(0); //According to Qt documentation, this shouldn't be necessary, "The layout will automatically reparent the widgets (using QWidget::setParent()) so that they are children of the widget on which the layout is installed"
+    node.attached = false;
+           
+    insertToLayout(index,layoutStack.top(),opts);
+  }
+}
+
+// Widgets whose stretch or alignment in a box layout, or whose cell in a grid layout, changed from the last call
+// to update() must be reinserted to their parentLayout. New and reinserted box items go to the index given by the value
+// at the top of the orderStack, the order of the rest is restored by arrangeBoxLayout().
+void reinsertWidget(int index,const OptsPrivate& opts)
+{
+  Node& node = nodeTable[index];
+  
+  assert(node.attached);
+  assert(node.parentLayout!=0); 
+  
+  if (needsReinsert(node,node.parentLayout,opts))
+  {
+    QWidget* widget = (QWidget*)node.object;
+    
+    qDebug("reinserting widget %s",qPrintable(widget->objectName()));
+    node.parentLayout->removeWidget(widget);    
+    insertToLayout(index,node.parentLayout,opts);
+  }
+}
+
+void deleteLayout(int index)
+{
+  QLayout* layout = (QLayout*)nodeTable[index].object;
+  
+  qDebug("deleting layout %s",qPrintable(layout->objectName()));fflush(stdout);
+  
+  // QLayout si udrzuje reference na svoje sub-layouty jako potomky pomoci children mechanizmu QObjectu.
+  // V momente kdy smazu layout, smaze jeho destruktor i vsechny svoje children sub-layouty,
+  // a rekurzivne se tak smaze celej podstrom layoutuu zakorenenej v tomhle layoutu.
+  //
+  // To je sice pekny, ale ja se tohohle chovani potrebuju zbavit, protoze si chci vsechny vytvoreny layouty
   // smazat sam, rucne, v libovolnym poradi.
   //
   // Takze musim rozpojit Parent<--Child vazby mezi timhle layoutem a jeho sub-layoutama, a teprv potom
@@ -504,9 +1318,11 @@ void deleteLayout(QLayout* layout)
    
     assert(item!=0);
     
-    if (parentLayout.contains(item) && parentLayout[item]==layout)
+    int itemIndex = nodeTable.nodeOf(item);
+    
+    if (itemIndex!=-1 && nodeTable[itemIndex].attached && nodeTable[itemIndex].parentLayout==layout)
     {
-      parentLayout[item] = (QLayout*)-1;      
+      nodeTable[itemIndex].attached = false;      
     }    
   }
   //printf("OK1\n"); fflush(stdout);
@@ -521,16 +1337,12 @@ void deleteLayout(QLayout* layout)
   }
   //printf("OK2\n"); fflush(stdout);
   
-  ///////////////////////////////////
-  if (parentLayout[layout]!=(QLayout*)-1 && parentLayout[layout]!=0)  parentLayout[layout]->removeItem(layout);
-  ///////////
+  Node& node = nodeTable[index];
+  
+  if (node.attached && node.parentLayout!=0) node.parentLayout->removeItem(layout);
   //printf("OK3\n"); fflush(stdout);
   
-  parentLayout.remove(layout);
-  if (layoutPosition.contains(layout)) layoutPosition.remove(layout);
-  fresh.remove(layout);
-
-  layouts.remove(layout->property("id").toInt());
+  nodeTable.remove(index);
   //printf("OK4\n"); fflush(stdout);
     
   // Layout uz ted nema zadny potomky, takze ho vesle smazu
@@ -538,74 +1350,406 @@ void deleteLayout(QLayout* layout)
   //printf("OK5\n"); fflush(stdout);
 };
 
-void deleteWidget(QWidget* widget)
+// Roots of vanished subtrees, detached and hidden, waiting for deleteDetached().
+QVector<QObject*> teardownQueue;
+
+int creationBudget = 0; // ms per frame, 0 means no limit
+int teardownBudget = 0;
+
+QElapsedTimer creationClock; // started by the first widget constructed in a frame
+
+// Widgets over the construction budget of this frame are not created until a later frame.
+// The first widget of every frame is always built, so the backlog keeps moving.
+bool deferCreation()
 {
-  qDebug("deleting widget %s",qPrintable(widget->objectName()));fflush(stdout);
-       
-  if (widget->layout()!=0) deleteLayout(widget->layout());  
+  if (creationBudget==0) return false;
   
-  // Dal musime rozpojit vazby mezi samotnym groupboxem a jeho child widgetama
-  QObjectList children = widget->children();
-  for (int i = 0; i < children.size(); ++i)
+  if (!creationClock.isValid())
   {
-    //printf("%s->children(%d)=%s\n",qPrintable(widget->objectName()),i,qPrintable(children.at(i)->objectName()));
-    if (QWidget* widget = qobject_cast<QWidget*>(children.at(i)))
+    creationClock.start();
+    return false;
+  }
+  
+  if (creationClock.elapsed()<creationBudget) return false;
+  
+  frameStats.widgetsDeferred++;
+  
+  return true;
+}
+
+// A GLContextPrivate belongs to its GLContext, it is only hidden when it vanishes.
+void rescueGLWidget(int index)
+{
+  Node& node = nodeTable[index];
+  QWidget* widget = (QWidget*)node.object;
+  
+  if (node.attached) node.parentLayout->removeWidget(widget);
+  
+  nodeTable.remove(index);
+  
+  widget->clearFocus();
+  widget->setParent(0);
+  widget->hide();
+}
+
+// Removes the nodes of all objects that were not declared during this frame. Parents come before their
+// children in the stale lists, so an object is the root of a vanished subtree when its parent did not vanish.
+// Only the roots are detached, root widgets are queued for deleteDetached(), root layouts are deleted at once
+// (their widgets are detached already), everything below a root goes down with it.
+void detachStaleObjects()
+{
+  QSet<QObject*> vanished;
+  QVector<QLayout*> rootLayouts;
+  
+  while (!nodeTable.isEmpty(NodeTable::StaleWidgets))
+  {
+    int index = nodeTable.first(NodeTable::StaleWidgets);
+    Node& node = nodeTable[index];
+    QWidget* widget = (QWidget*)node.object;
+    
+    //// HACK !!!!
+    if (widget->inherits("GLContextPrivate"))
+    {
+      rescueGLWidget(index);
+      continue;
+    }
+    
+    if (vanished.contains(widget->parentWidget()))
     {
-      widget->clearFocus();
-      widget->setParent(0);
+      vanished.insert(widget);
+      nodeTable.remove(index);
+      continue;
     }
+    
+    if (recycleWidget(index)) continue;
+    
+    vanished.insert(widget);
+    
+    if (node.attached) node.parentLayout->removeWidget(widget);
+    
+    nodeTable.remove(index);
+    
+    widget->clearFocus();
+    
+    if (widget->parentWidget()!=0) widget->setParent(0); else widget->hide();
+    
+    teardownQueue.push_back(widget);
   }
-   
-  ///////////////////////////////////
-  if (parentLayout[widget]!=(QLayout*)-1) parentLayout[widget]->removeWidget(widget);
   
-  /////////////////////////////////////
+  while (!nodeTable.isEmpty(NodeTable::StaleLayouts))
+  {
+    int index = nodeTable.first(NodeTable::StaleLayouts);
+    Node& node = nodeTable[index];
+    QLayout* layout = (QLayout*)node.object;
+    
+    if (!vanished.contains(layout->parent()))
+    {
+      if (node.attached && node.parentLayout!=0) node.parentLayout->removeItem(layout);
+      
+      rootLayouts.push_back(layout);
+    }
+    
+    vanished.insert(layout);
+    nodeTable.remove(index);
+  }
   
-  parentLayout.remove(widget);
-  if (layoutPosition.contains(widget)) layoutPosition.remove(widget);
-  //if (order.contains(widget)) order.remove(widget);
-  fresh.remove(widget);
-  widgets.remove(widget->property("id").toInt());
+  for(int i=0;i<rootLayouts.size();i++) delete rootLayouts[i];
+}
+
+// Library objects among the children of object, the rest are internals of the Qt widget.
+QObject* lastLibraryChild(QObject* object)
+{
+  const QObjectList& children = object->children();
   
-  widget->clearFocus();
+  for(int i=children.size()-1;i>=0;i--)
+  {
+    if (children.at(i)->property("id").isValid()) return children.at(i);
+  }
   
-  //// HACK !!!!
-  if (widget->inherits("GLContextPrivate"))
+  return 0;
+}
+
+// Deletes the queued subtrees bottom-up, one library object at a time, until budgetMs runs out (0 means no limit).
+// A run that stopped midway leaves a path of descendants after their root, so the queue is always emptied
+// from the back: a child is gone before its parent deletes its remaining children.
+void deleteDetached(int budgetMs)
+{
+  if (budgetMs==0)
   {
-    widget->hide();
+    while (!teardownQueue.isEmpty())
+    {
+      delete teardownQueue.back();
+      teardownQueue.pop_back();
+    }
+    return;
   }
-  else
+  
+  QElapsedTimer clock;
+  clock.start();
+  
+  while (!teardownQueue.isEmpty() && clock.elapsed()<budgetMs)
+  {
+    QObject* object = teardownQueue.back();
+    QObject* child = lastLibraryChild(object);
+    
+    if (child!=0)
+    {
+      teardownQueue.push_back(child);
+    }
+    else
+    {
+      teardownQueue.pop_back();
+      delete object;
+    }
+  }
+}
+
+// Memoized block between CacheBegin() and CacheEnd(). Nodes are refreshed in declaration order, so everything
+// an executed block declared forms one run in each fresh list, which a skipped block moves back as a whole.
+struct CacheBlock
+{
+  CacheBlock() : hash(0), generation(0), skipped(0), parent(0), layout(0), deferred(false)
+  {
+    first[0] = first[1] = -1;
+    last[0] = last[1] = -1;
+  }
+  
+  quint64 hash;
+  uint generation;     // frame in which the block was declared last time
+  uint skipped;        // frame in which the block was skipped last time
+  quint64 parent;      // uid of the enclosing block, 0 if none
+  QLayout* layout;     // layout on top of the layoutStack at CacheBegin()
+  bool deferred;       // the last run left widgets to later frames by the creation budget
+  int first[2];        // runs in FreshWidgets and FreshLayouts, -1 when empty
+  int last[2];
+  QVector<int> items;  // nodes declared directly into layout
+};
+
+struct CacheFrame
+{
+  quint64 uid;
+  bool executed;
+  int depth;           // size of the layoutStack at CacheBegin()
+  int deferred;        // widgets deferred in this frame before CacheBegin()
+  int before[2];       // tails of FreshWidgets and FreshLayouts at CacheBegin()
+  QVector<int> items;
+};
+
+QHash<quint64,CacheBlock> cacheBlocks;
+QStack<CacheFrame> cacheStack;
+
+// true when the block, or a block enclosing it, was skipped this frame and so kept its nodes alive without touching them
+bool keptByCache(quint64 block)
+{
+  while (block!=0)
+  {
+    QHash<quint64,CacheBlock>::const_iterator it = cacheBlocks.constFind(block);
+    
+    if (it==cacheBlocks.constEnd()) return false;
+    if (it.value().skipped==frameGeneration) return true;
+    
+    block = it.value().parent;
+  }
+  
+  return false;
+}
+
+// Declared in this frame, either directly or by a skipped block that kept it without touching it
+bool declaredThisFrame(const Node& node)
+{
+  return node.generation==frameGeneration || keptByCache(node.block);
+}
+
+// Widget that fetchCachedWidget() found declared already in this frame, finalizeWidget() leaves it in place
+int collidedNode = -1;
+
+// Finding an object that was declared already in this frame means two declarations hashed to the same id.
+bool checkCollision(const Node& node)
+{
+  if (!declaredThisFrame(node)) return false;
+  
+  frameStats.idCollisions++;
+  qWarning("Warning: id collision on %s!",qPrintable(node.object->objectName()));
+  
+  return true;
+}
+
+void refresh(int index)
+{
+  Node& node = nodeTable[index];
+  
+  if (node.generation==frameGeneration) return;
+  
+  node.generation = frameGeneration;
+  node.block = cacheStack.isEmpty() ? 0 : cacheStack.top().uid;
+  nodeTable.unlink(index);
+  nodeTable.link(index,node.isLayout() ? NodeTable::FreshLayouts : NodeTable::FreshWidgets);
+}
+
+// Items declared during this frame in each box layout on the layoutStack, indexed by stack depth.
+struct BoxFrame
+{
+  BoxFrame() : layout(0) {}
+  
+  QBoxLayout* layout; // 0 when the layout at this depth is not a box layout
+  QVector<int> items;
+};
+
+QVector<BoxFrame> boxFrames;
+
+void declareBoundItems(quint64 uid);
+void declareRemainingBoundItems();
+
+// Registers a widget or layout declared into the layout on top of the layoutStack.
+void declareItem(int index)
+{
+  int depth = layoutStack.size()-1;
+  
+  if (layoutStack.top()!=0 && depth<boxFrames.size() && boxFrames[depth].layout==layoutStack.top())
   {
-    delete widget;  
-  }    
+    boxFrames[depth].items.push_back(index);
+  }
+  
+  if (!cacheStack.isEmpty() && cacheStack.top().depth==layoutStack.size())
+  {
+    cacheStack.top().items.push_back(index);
+  }
+}
+
+int layoutItemIndex(QLayout* layout,QObject* object)
+{
+  for(int i=0;i<layout->count();i++)
+  {
+    QLayoutItem* item = layout->itemAt(i);
+    
+    if (item->widget()==object || item->layout()==object) return i;
+  }
+  
+  return -1;
+}
+
+// Marks in keep the values of the longest increasing subsequence of sequence, O(n log n).
+void longestIncreasingSubsequence(const QVector<int>& sequence,QVector<bool>& keep)
+{
+  QVector<int> tails;  // tails[l] is the position of the smallest last value of an increasing run of length l+1
+  QVector<int> previous(sequence.size());
+  
+  for(int i=0;i<sequence.size();i++)
+  {
+    int lo = 0;
+    int hi = tails.size();
+    
+    while (lo<hi)
+    {
+      int mid = (lo+hi)/2;
+      if (sequence[tails[mid]]<sequence[i]) lo = mid+1; else hi = mid;
+    }
+    
+    previous[i] = (lo>0) ? tails[lo-1] : -1;
+    
+    if (lo==tails.size()) tails.push_back(i); else tails[lo] = i;
+  }
+  
+  for(int i=tails.isEmpty() ? -1 : tails.last();i!=-1;i=previous[i]) keep[sequence[i]] = true;
 }
 
-void refresh(QObject* object)
+// Called by *LayoutEnd(). The items keep their declaration index in position.order, so as long as all of them
+// kept their index from the last frame the layout is already in order. Otherwise the items that form the longest
+// run already in declaration order stay, and only the others are moved, each right before its declared successor.
+// Items that were not declared are left where they are, guiUpdate() deletes them.
+void arrangeBoxLayout()
 {
-  fresh.insert(object);   
+  BoxFrame& frame = boxFrames[layoutStack.size()-1];
+  
+  // not arranged, like a layout declared twice under one id
+  if (frame.layout!=layoutStack.top()) return;
+  
+  const QVector<int>& items = frame.items;
+  int n = items.size();
+  
+  bool ordered = true;
+  
+  for(int k=0;k<n && ordered;k++) ordered = (nodeTable[items[k]].position.order==k);
+  
+  if (!ordered)
+  {
+    QBoxLayout* layout = frame.layout;
+    
+    QHash<QObject*,int> ranks;
+    for(int k=0;k<n;k++) ranks.insert(nodeTable[items[k]].object,k);
+    
+    // declaration indices of the items in their current layout order
+    QVector<int> sequence;
+    sequence.reserve(n);
+    
+    for(int i=0;i<layout->count();i++)
+    {
+      QLayoutItem* item = layout->itemAt(i);
+      QObject* object = (item->widget()!=0) ? (QObject*)item->widget() : (QObject*)item->layout();
+      
+      int k = ranks.value(object,-1);
+      if (k!=-1) sequence.push_back(k);
+    }
+    
+    // an item that is not in the layout, or is declared twice, leaves the layout as it is for this frame
+    if (sequence.size()!=n) return;
+    
+    QVector<bool> keep(n,false);
+    longestIncreasingSubsequence(sequence,keep);
+    
+    QObject* successor = 0;
+    
+    for(int k=n-1;k>=0;k--)
+    {
+      Node& node = nodeTable[items[k]];
+      
+      if (!keep[k])
+      {
+        Qt::Alignment alignment = (Qt::Alignment)node.position.alignment;
+        
+        if (QWidget* widgetItem = qobject_cast<QWidget*>(node.object))
+        {
+          layout->removeWidget(widgetItem);
+          layout->insertWidget(successor ? layoutItemIndex(layout,successor) : -1,widgetItem,node.position.stretch,alignment);
+        }
+        else if (QLayout* layoutItem = qobject_cast<QLayout*>(node.object))
+        {
+          layout->removeItem(layoutItem);
+          layoutItem->setParent(0);
+          layout->insertLayout(successor ? layoutItemIndex(layout,successor) : -1,layoutItem,node.position.stretch);
+        }
+        
+        frameStats.layoutMoves++;
+      }
+      
+      successor = node.object;
+    }
+  }
+  
+  for(int k=0;k<n;k++) nodeTable[items[k]].position.order = k;
 }
 
-void initializeWidget(int id,QWidget* widget,const OptsPrivate& opts)
+int initializeWidget(int id,QWidget* widget,const OptsPrivate& opts)
 {
   widget->setObjectName(QString("%1[%2]").arg(widget->metaObject()->className()).arg(id));
   
   qDebug("creating widget %s",qPrintable(widget->objectName()));
+  
+  quint64 uid = scopedId(id);
+  
+  captureOptDefaults(widget);
+  
+  int index = nodeTable.insert(uid,false,widget);
+  widget->setProperty("id",(qulonglong)uid);
+  
+  if (IMWidget* imWidget = dynamic_cast<IMWidget*>(widget)) imWidget->node = index;
  
   // this is toplevel window
-  if (widgetStack.empty())
-  {
-    parentLayout[widget] = (QLayout*)-1;
-    //order[widget] = -1;  
-    widgets[id] = widget;    
-    widget->setProperty("id",id);
-
-    return;    
-  }
+  if (widgetStack.empty()) return index;
   
   QLayout* topLayout = layoutStack.top();  
   assert(topLayout!=0);
-  insertToLayout(widget,topLayout,opts);
-  parentLayout[widget] = layoutStack.top();
+  insertToLayout(index,topLayout,opts);
 
   /*
   assert(topLayout!=0);
@@ -614,22 +1758,22 @@ void initializeWidget(int id,QWidget* widget,const OptsPrivate& opts)
   {
     boxLayout->insertWidget(orderStack.top(),
                             widget,
-                            opts.get<int>("stretch",0),
-                            (Qt::Alignment)opts.get<int>("flush",0));
+                            opts.get<int>(OptStretch,0),
+                            (Qt::Alignment)opts.get<int>(OptAlign,0));
   }
   else if (QGridLayout* gridLayout = qobject_cast<QGridLayout*>(topLayout))
   {
-    if (!opts.isSet("gridRow") || !opts.isSet("gridColumn"))
+    if (!opts.isSet(OptGridRow) || !opts.isSet(OptGridColumn))
     {
       printf("Error: cell not set!\n");
     }
     
     gridLayout->addWidget(widget,
-                          opts.get<int>("gridRow",0),
-                          opts.get<int>("gridColumn",0),
-                          opts.get<int>("gridRowSpan",1),
-                          opts.get<int>("gridColumnSpan",1),
-                          (Qt::Alignment)opts.get<int>("flush",0));
+                          opts.get<int>(OptGridRow,0),
+                          opts.get<int>(OptGridColumn,0),
+                          opts.get<int>(OptGridRowSpan,1),
+                          opts.get<int>(OptGridColumnSpan,1),
+                          (Qt::Alignment)opts.get<int>(OptAlign,0));
   }
   else
   {
@@ -640,50 +1784,154 @@ void initializeWidget(int id,QWidget* widget,const OptsPrivate& opts)
   
   //parentLayout[widget] = layoutStack.top();
   //order[widget] = orderStack.top();  
-  widgets[id] = widget;    
-  widget->setProperty("id",id);
+
+  return index;
 }
 
-void finalizeWidget(QWidget* widget,const OptsPrivate& opts)
+InputPump inputPump = InputPumpInGuiUpdate;
+bool framePumped = false;
+
+// Widgets that received input from a pump in the middle of the frame after they had been declared,
+// their state survives the next guiUpdate() so that the following frame returns it.
+QVector<IMWidget*> lateInputWidgets;
+
+// Input arrived through a pump during the frame being built. updateState() forgets the activity, so
+// guiUpdate() carries it to lateInputPending, which makes it and guiWaitForInvalidation() return true
+// until the next frame is built.
+bool lateInput = false;
+bool lateInputPending = false;
+
+void pumpInput()
 {
+  int first = dirtyWidgets.size();
+  
+  // key state and the event stream the frame already looked at are held back the same way
+  inputCapture->deferring = inputCapture->queried || !inputCapture->deferred.isEmpty();
+  
+  bool active = inputCapture->activity;
+  inputCapture->activity = false;
+  
+  app->processEvents();
+  
+  if (inputCapture->activity) lateInput = true;
+  
+  inputCapture->activity = inputCapture->activity || active;
+  inputCapture->deferring = false;
+  
+  for(int i=first;i<dirtyWidgets.size();i++)
+  {
+    int index = dirtyWidgets[i]->node;
+    
+    if (index!=-1 && declaredThisFrame(nodeTable[index])) lateInputWidgets.push_back(dirtyWidgets[i]);
+  }
+}
+
+InputLatencyHook inputLatencyHook = 0;
+
+// Called before the changed widgets are reset. Those declared in this frame, and not late, had their
+// value returned by the widget function. The time is taken once here, at the end of the frame.
+void reportInputLatency()
+{
+  qint64 now = latencyClock.nsecsElapsed();
+  
+  for(int i=0;i<changedWidgets.size();i++)
+  {
+    IMWidget* imWidget = changedWidgets[i];
+    
+    if (imWidget->changeTime==-1 || lateInputWidgets.contains(imWidget)) continue;
+    
+    int index = imWidget->node;
+    
+    // a block that was skipped did not return the value
+    if (index!=-1 && nodeTable[index].generation==frameGeneration && !keptByCache(nodeTable[index].block))
+    {
+      inputLatencyHook(nodeTable[index].uid,(int)((now-imWidget->changeTime)/1000));
+    }
+  }
+}
+
+void finalizeWidget(int index,const OptsPrivate& opts)
+{
+  QWidget* widget = (QWidget*)nodeTable[index].object;
+  
+  // the first declaration keeps its place
+  if (index==collidedNode)
+  {
+    collidedNode = -1;
+    applyOpts(widget,nodeTable.appliedOpts(index),opts);
+    return;
+  }
+  
   // this is toplevel window
   if (widgetStack.empty())
   {
-    refresh(widget);
-    applyOpts(widget,opts);
+    refresh(index);
+    applyOpts(widget,nodeTable.appliedOpts(index),opts);
     return;
   }
 
-  reparentWidget(widget,opts);
-  reinsertWidget(widget,opts);
-  refresh(widget);
+  reparentWidget(index,opts);
+  reinsertWidget(index,opts);
+  refresh(index);
   
-  applyOpts(widget,opts);
+  applyOpts(widget,nodeTable.appliedOpts(index),opts);
+  
+  declareItem(index);
   
   orderStack.top() = orderStack.top()+1;  
 }
 
+// Makes layout the target of the following declarations. Box layouts that are arranged get their items
+// collected for arrangeBoxLayout().
+void pushLayout(QLayout* layout,bool arrange)
+{
+  layoutStack.push(layout);  
+  orderStack.push(0);
+  
+  int depth = layoutStack.size()-1;
+  
+  if (boxFrames.size()<=depth) boxFrames.resize(depth+1);
+  
+  boxFrames[depth].layout = arrange ? qobject_cast<QBoxLayout*>(layout) : 0;
+  boxFrames[depth].items.resize(0);
+}
+
 template<typename T> T* processLayout(int id,const OptsPrivate& opts)
 {
   assert(widgetStack.empty()==false);
   
   T* layout = 0;
   
+  quint64 uid = scopedId(id);
+  
+  declareBoundItems(uid);
+  
+  int index = nodeTable.find(uid,true);
+  
   // REPARENT PHASE
-  if (layouts.contains(id))
+  if (index!=-1)
   {
-    layout = (T*)layouts[id];
+    Node& node = nodeTable[index];
+    
+    // the first declaration keeps its place, the second one only fills the layout
+    if (checkCollision(node))
+    {
+      pushLayout((QLayout*)node.object,false);
+      return qobject_cast<T*>(node.object);
+    }
+    
+    layout = (T*)node.object;
     
-    if (parentLayout[layout]!=layoutStack.top())
+    if (!node.attached || node.parentLayout!=layoutStack.top())
     { 
-      deleteLayout(layout); 
+      deleteLayout(index); 
       layout = 0;
     }
-    else if (parentLayout[layout]==0 && layoutStack.top()==0)
+    else if (node.parentLayout==0 && layoutStack.top()==0)
     {
       if (layout->parentWidget()!=widgetStack.top())
       {
-        deleteLayout(layout);
+        deleteLayout(index);
         layout = 0;
       }
     }      
@@ -696,9 +1944,8 @@ template<typename T> T* processLayout(int id,const OptsPrivate& opts)
 
     qDebug("creating layout %s",qPrintable(layout->objectName()));
 
-
-    layout->setProperty("id",id);
-    layouts[id] = layout;
+    layout->setProperty("id",(qulonglong)uid);
+    index = nodeTable.insert(uid,true,layout);
     
     if (layoutStack.top()==0)
     {
@@ -706,48 +1953,53 @@ template<typename T> T* processLayout(int id,const OptsPrivate& opts)
       
       if (widgetStack.top()->layout()!=0)
       {
-        deleteLayout(widgetStack.top()->layout());
+        int oldIndex = nodeTable.nodeOf(widgetStack.top()->layout());
+        if (oldIndex!=-1) deleteLayout(oldIndex);
       }
       
       widgetStack.top()->setLayout(layout);
+      
+      nodeTable[index].parentLayout = 0;
+      nodeTable[index].attached = true;
     }
     else
     {
-      insertToLayout(layout,layoutStack.top(),opts);//((QBoxLayout*)layoutStack.top())->insertLayout(orderStack.top(),layout);      
+      insertToLayout(index,layoutStack.top(),opts);//((QBoxLayout*)layoutStack.top())->insertLayout(orderStack.top(),layout);      
     }
     
-    parentLayout[layout] = layoutStack.top();
     //order[layout] = orderStack.top();
   }
   else
   {    
-    if (parentLayout[layout]!=0)
+    Node& node = nodeTable[index];
+    
+    if (node.parentLayout!=0)
     {
       // REINSERT PHASE
-      if (needsReinsert(layout,layoutStack.top(),opts))
+      if (needsReinsert(node,layoutStack.top(),opts))
       {    
         qDebug("reinserting %s",qPrintable(layout->objectName()));
     
-        parentLayout[layout]->removeItem(layout);
+        node.parentLayout->removeItem(layout);
         layout->setParent(0);
-        parentLayout[layout] = (QLayout*)-1;
+        node.attached = false;
 
-        insertToLayout(layout,layoutStack.top(),opts);
-        parentLayout[layout] = layoutStack.top();
+        insertToLayout(index,layoutStack.top(),opts);
       }      
     }  
   }
   
   assert(layout!=0);
    
-  applyOpts(layout,opts);
+  applyOpts(layout,nodeTable.appliedOpts(index),opts);
 
-  refresh(layout);
+  refresh(index);
+  
+  declareItem(index);
   
   orderStack.top() = orderStack.top()+1;  
 
-  layoutStack.push(layout);  
-  orderStack.push(0);
+  pushLayout(layout,true);
   
   return layout;
 }
@@ -759,6 +2011,9 @@ void HBoxLayoutBegin(int id,const Opts& opts)
 
 void HBoxLayoutEnd()
 {
+  declareRemainingBoundItems();
+  arrangeBoxLayout();
+  
   layoutStack.pop();
   orderStack.pop();
 }
@@ -770,10 +2025,162 @@ void VBoxLayoutBegin(int id,const Opts& opts)
 
 void VBoxLayoutEnd()
 {
+  declareRemainingBoundItems();
+  arrangeBoxLayout();
+  
   layoutStack.pop();
   orderStack.pop();
 }
 
+// Blocks that declared a widget which received input since the last frame, together with the blocks enclosing
+// them. Rebuilt from the dirty list once per frame, and again when input pumped during the frame extends it.
+QSet<quint64> blocksWithInput;
+uint blocksWithInputGeneration = 0;
+int blocksWithInputDirty = -1;
+
+// true when a widget declared inside the block uid (or inside a block nested in it) received input since the last frame
+bool cacheBlockHasInput(quint64 uid)
+{
+  if (blocksWithInputGeneration!=frameGeneration || blocksWithInputDirty!=dirtyWidgets.size())
+  {
+    blocksWithInput.clear();
+    
+    for(int i=0;i<dirtyWidgets.size();i++)
+    {
+      int index = dirtyWidgets[i]->node;
+      
+      if (index==-1 || nodeTable[index].object==0) continue;
+      
+      for(quint64 block=nodeTable[index].block;block!=0 && !blocksWithInput.contains(block);)
+      {
+        blocksWithInput.insert(block);
+        
+        QHash<quint64,CacheBlock>::const_iterator it = cacheBlocks.constFind(block);
+        block = (it!=cacheBlocks.constEnd()) ? it.value().parent : 0;
+      }
+    }
+    
+    blocksWithInputGeneration = frameGeneration;
+    blocksWithInputDirty = dirtyWidgets.size();
+  }
+  
+  return blocksWithInput.contains(uid);
+}
+
+bool cacheBlockIsIntact(const CacheBlock& block)
+{
+  for(int l=0;l<2;l++)
+  {
+    if (block.first[l]==-1) continue;
+    
+    const Node& first = nodeTable[block.first[l]];
+    const Node& last = nodeTable[block.last[l]];
+    
+    if (first.object==0 || first.generation!=block.generation) return false;
+    if (last.object==0 || last.generation!=block.generation) return false;
+  }
+  
+  return true;
+}
+
+bool CacheBegin(int id,unsigned long long inputsHash)
+{
+  CacheFrame frame;
+  frame.uid = scopedId(id);
+  frame.depth = layoutStack.size();
+  frame.deferred = frameStats.widgetsDeferred;
+  
+  QLayout* layout = layoutStack.isEmpty() ? 0 : layoutStack.top();
+  
+  CacheBlock& block = cacheBlocks[frame.uid];
+  
+  frame.executed = !(block.generation==frameGeneration-1 &&
+                     block.hash==inputsHash &&
+                     block.layout==layout &&
+                     !block.deferred &&
+                     cacheBlockIsIntact(block) &&
+                     !cacheBlockHasInput(frame.uid));
+  
+  if (frame.executed)
+  {
+    block.hash = inputsHash;
+    block.parent = cacheStack.isEmpty() ? 0 : cacheStack.top().uid;
+    block.layout = layout;
+    
+    frame.before[0] = nodeTable.last(NodeTable::FreshWidgets);
+    frame.before[1] = nodeTable.last(NodeTable::FreshLayouts);
+  }
+  else
+  {
+    const int lists[2] = { NodeTable::FreshWidgets, NodeTable::FreshLayouts };
+    
+    for(int l=0;l<2;l++)
+    {
+      if (block.first[l]==-1) continue;
+      
+      nodeTable.moveRun(block.first[l],block.last[l],lists[l]);
+      
+      // only the ends of the runs are stamped, they are what cacheBlockIsIntact() checks
+      nodeTable[block.first[l]].generation = frameGeneration;
+      nodeTable[block.last[l]].generation = frameGeneration;
+    }
+    
+    // before the items are declared, so that the bound widgets among them count as declared
+    block.skipped = frameGeneration;
+    
+    QVector<int> items = block.items;
+    
+    for(int i=0;i<items.size();i++)
+    {
+      declareBoundItems(nodeTable[items[i]].uid);
+      declareItem(items[i]);
+      orderStack.top() = orderStack.top()+1;
+    }
+    
+    frameStats.blocksSkipped++;
+  }
+  
+  cacheBlocks[frame.uid].generation = frameGeneration;
+  
+  cacheStack.push(frame);
+  
+  return frame.executed;
+}
+
+void CacheEnd()
+{
+  assert(cacheStack.empty()==false);
+  
+  CacheFrame frame = cacheStack.pop();
+  
+  assert(frame.depth==layoutStack.size());
+  
+  if (!frame.executed) return;
+  
+  CacheBlock& block = cacheBlocks[frame.uid];
+  
+  const int lists[2] = { NodeTable::FreshWidgets, NodeTable::FreshLayouts };
+  
+  for(int l=0;l<2;l++)
+  {
+    int last = nodeTable.last(lists[l]);
+    
+    if (last==frame.before[l])
+    {
+      block.first[l] = -1;
+      block.last[l] = -1;
+    }
+    else
+    {
+      block.first[l] = nodeTable[frame.before[l]].next;
+      block.last[l] = last;
+    }
+  }
+  
+  block.items = frame.items;
+  block.deferred = (frameStats.widgetsDeferred!=frame.deferred);
+}
+
 void GridLayoutBegin(int id,const Opts& opts)
 {
   processLayout<QGridLayout>(id,*opts.opts);
@@ -785,52 +2192,64 @@ void GridLayoutEnd()
   orderStack.pop();
 }
 
-template<typename T> T* fetchCachedWidget(int id)
+template<typename T> T* fetchCachedWidget(int id,int* index)
 {
-  if (widgets.contains(id))
-  {
-    QWidget* widget = widgets[id];
+  quint64 uid = scopedId(id);
+  
+  declareBoundItems(uid);
+  
+  *index = nodeTable.find(uid,false);
+  
+  collidedNode = -1;
+  
+  if (*index==-1) return 0;
+  
+  if (checkCollision(nodeTable[*index])) collidedNode = *index;
+  
+  QWidget* widget = (QWidget*)nodeTable[*index].object;
     
-    assert(qobject_cast<T*>(widget)!=0); // probably due to id collision
+  assert(qobject_cast<T*>(widget)!=0); // probably due to id collision
     
-    return (T*)widget;
-  }
-  else
-  {
-    return 0;
-  }  
+  return (T*)widget;
 }
 
 void Label(int id,const char* text,const Opts& opts)
 {
-  QLabel* label = fetchCachedWidget<QLabel>(id);
+  int node = -1;
+  QLabel* label = fetchCachedWidget<QLabel>(id,&node);
   
   if (label==0)
   {
-    label = new QLabel(text);
+    if (deferCreation()) return;
+    
+    label = recycledWidget<QLabel>();
+    if (label==0) label = new QLabel(text);
     
-    initializeWidget(id,label,*opts.opts);
+    node = initializeWidget(id,label,*opts.opts);
   }
   
-  label->setText(text);
+  if (shadowChanged(nodeTable.appliedOpts(node).text,text)) label->setText(text);
   
-  finalizeWidget(label,*opts.opts);
+  finalizeWidget(node,*opts.opts);
 }
 
 template<int Style> void Separator(int id,const Opts& opts)
 {
-  QFrame* separator = fetchCachedWidget<QFrame>(id);
+  int node = -1;
+  QFrame* separator = fetchCachedWidget<QFrame>(id,&node);
 
   if (separator==0)
   {
+    if (deferCreation()) return;
+    
     separator = new QFrame();
     
     separator->setFrameStyle(Style | QFrame::Sunken);
     
-    initializeWidget(id,separator,*opts.opts);
+    node = initializeWidget(id,separator,*opts.opts);
   }
   
-  finalizeWidget(separator,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
 }
 
 void HSeparator(int id,const Opts& opts)
@@ -845,25 +2264,31 @@ void VSeparator(int id,const Opts& opts)
 
 bool Button(int id,const char* iconFileName,const char* text,const Opts& opts)
 {
-  IMButton* button = fetchCachedWidget<IMButton>(id);
+  int node = -1;
+  IMButton* button = fetchCachedWidget<IMButton>(id,&node);
 
   if (button==0)
   {
-    button = new IMButton(text);    
+    if (deferCreation()) return false;
+    
+    button = recycledWidget<IMButton>();
+    if (button==0) button = new IMButton(text);
    
-    initializeWidget(id,button,*opts.opts);
+    node = initializeWidget(id,button,*opts.opts);
   }
   
-  if (QString(iconFileName).isEmpty()==false)
+  AppliedOpts& applied = nodeTable.appliedOpts(node);
+  
+  if (QString(iconFileName).isEmpty()==false && shadowChanged(applied.icon,iconFileName))
   {
     QIcon icon(iconFileName);
     button->setIcon(icon);
     button->setIconSize(icon.availableSizes()[0]);    
   }
 
-  button->setText(text);
+  if (shadowChanged(applied.text,text)) button->setText(text);
 
-  finalizeWidget(button,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
 
   return button->buttonWasClicked;
 }
@@ -875,23 +2300,29 @@ bool Button(int id,const char* text,const Opts& opts)
 
 bool ToggleButton(int id,const char* iconFileName,const char* text,bool* state,const Opts& opts)
 {
-  IMToggleButton* toggleButton = fetchCachedWidget<IMToggleButton>(id);
+  int node = -1;
+  IMToggleButton* toggleButton = fetchCachedWidget<IMToggleButton>(id,&node);
 
   if (toggleButton==0)
   {
-    toggleButton = new IMToggleButton(text);    
+    if (deferCreation()) return false;
+    
+    toggleButton = recycledWidget<IMToggleButton>();
+    if (toggleButton==0) toggleButton = new IMToggleButton(text);
    
-    initializeWidget(id,toggleButton,*opts.opts);
+    node = initializeWidget(id,toggleButton,*opts.opts);
   }
   
-  if (QString(iconFileName).isEmpty()==false)
+  AppliedOpts& applied = nodeTable.appliedOpts(node);
+  
+  if (QString(iconFileName).isEmpty()==false && shadowChanged(applied.icon,iconFileName))
   {
     QIcon icon(iconFileName);
     toggleButton->setIcon(icon);
     toggleButton->setIconSize(icon.availableSizes()[0]);    
   }
   
-  toggleButton->setText(text);
+  if (shadowChanged(applied.text,text)) toggleButton->setText(text);
 
   if (toggleButton->isChecked()!=*state && toggleButton->isHot()==false)
   {
@@ -900,7 +2331,7 @@ bool ToggleButton(int id,const char* iconFileName,const char* text,bool* state,c
   
   *state = toggleButton->isChecked();
       
-  finalizeWidget(toggleButton,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
 
   return toggleButton->buttonWasToggled;
 }
@@ -912,16 +2343,20 @@ bool ToggleButton(int id,const char* text,bool* state,const Opts& opts)
 
 bool RadioButton(int id,const char* text,int tag,int* value,const Opts& opts)
 {
-  IMRadioButton* radioButton = fetchCachedWidget<IMRadioButton>(id);
+  int node = -1;
+  IMRadioButton* radioButton = fetchCachedWidget<IMRadioButton>(id,&node);
 
   if (radioButton==0)
   {
-    radioButton = new IMRadioButton(text);    
+    if (deferCreation()) return false;
+    
+    radioButton = recycledWidget<IMRadioButton>();
+    if (radioButton==0) radioButton = new IMRadioButton(text);
    
-    initializeWidget(id,radioButton,*opts.opts);
+    node = initializeWidget(id,radioButton,*opts.opts);
   }
   
-  radioButton->setText(text);
+  if (shadowChanged(nodeTable.appliedOpts(node).text,text)) radioButton->setText(text);
   
   bool changed = false;
   
@@ -942,23 +2377,27 @@ bool RadioButton(int id,const char* text,int tag,int* value,const Opts& opts)
     }
   }
         
-  finalizeWidget(radioButton,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
   
   return changed;
 }
 
 bool CheckBox(int id,const char* text,bool* state,const Opts& opts)
 {
-  IMCheckBox* checkBox = fetchCachedWidget<IMCheckBox>(id);
+  int node = -1;
+  IMCheckBox* checkBox = fetchCachedWidget<IMCheckBox>(id,&node);
 
   if (checkBox==0)
   {
-    checkBox = new IMCheckBox(text);    
+    if (deferCreation()) return false;
+    
+    checkBox = recycledWidget<IMCheckBox>();
+    if (checkBox==0) checkBox = new IMCheckBox(text);
    
-    initializeWidget(id,checkBox,*opts.opts);
+    node = initializeWidget(id,checkBox,*opts.opts);
   }
   
-  checkBox->setText(text);
+  if (shadowChanged(nodeTable.appliedOpts(node).text,text)) checkBox->setText(text);
 
   if (checkBox->isChecked()!=*state && checkBox->isHot()==false)
   {
@@ -967,7 +2406,7 @@ bool CheckBox(int id,const char* text,bool* state,const Opts& opts)
   
   *state = checkBox->isChecked();
       
-  finalizeWidget(checkBox,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
 
   return checkBox->checkBoxStateHasChanged;
 }
@@ -975,22 +2414,29 @@ bool CheckBox(int id,const char* text,bool* state,const Opts& opts)
 
 bool ComboBox(int id,int count,char** texts,int* index,const Opts& opts)
 {
-  IMComboBox* comboBox = fetchCachedWidget<IMComboBox>(id);
+  int node = -1;
+  IMComboBox* comboBox = fetchCachedWidget<IMComboBox>(id,&node);
 
   if (comboBox==0)
   {
-    comboBox = new IMComboBox();    
+    if (deferCreation()) return false;
+    
+    comboBox = recycledWidget<IMComboBox>();
+    if (comboBox==0) comboBox = new IMComboBox();
    
-    initializeWidget(id,comboBox,*opts.opts);
+    node = initializeWidget(id,comboBox,*opts.opts);
   }
   
-  if (count!=comboBox->count())
+  if (shadowChanged(nodeTable.appliedOpts(node).items,count,texts))
   {
-    comboBox->clear();
-    for(int i=0;i<count;i++) comboBox->insertItem(i,texts[i]);
-  }
+    if (count!=comboBox->count())
+    {
+      comboBox->clear();
+      for(int i=0;i<count;i++) comboBox->insertItem(i,texts[i]);
+    }
 
-  for(int i=0;i<count;i++) comboBox->setItemText(i,texts[i]);
+    for(int i=0;i<count;i++) comboBox->setItemText(i,texts[i]);
+  }
   
   
   bool changed = false;
@@ -1000,12 +2446,12 @@ bool ComboBox(int id,int count,char** texts,int* index,const Opts& opts)
     *index = comboBox->currentIndex();    
     changed = true;
   }
-  else
+  else if (comboBox->currentIndex()!=*index)
   {
     comboBox->setCurrentIndex(*index);
   }
         
-  finalizeWidget(comboBox,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
   
   return changed;
 }
@@ -1013,18 +2459,24 @@ bool ComboBox(int id,int count,char** texts,int* index,const Opts& opts)
 
 template<typename T,int orientation> bool AbstractSlider(int id,int min,int max,int* value,const Opts& opts)
 {
-  T* slider = fetchCachedWidget<T>(id);
+  int node = -1;
+  T* slider = fetchCachedWidget<T>(id,&node);
 
   if (slider==0)
   {
-    slider = new T();
+    if (deferCreation()) return false;
+    
+    slider = recycledWidget<T>();
+    if (slider==0) slider = new T();
     slider->setOrientation((Qt::Orientation)orientation);
-    initializeWidget(id,slider,*opts.opts);
+    node = initializeWidget(id,slider,*opts.opts);
   }
   
-  finalizeWidget(slider,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
   
-  slider->setRange(min,max);
+  int range[2] = { min, max };
+  
+  if (shadowChanged(nodeTable.appliedOpts(node).range,range,sizeof(range))) slider->setRange(min,max);
   
   if (slider->value()!=*value && slider->isHot()==false) slider->setValue(*value);
 
@@ -1042,28 +2494,36 @@ float round(float x)
 
 template<typename T,int orientation> bool AbstractFloatSlider(int id,float min,float max,float* value,const Opts& opts)
 {
-  T* slider = fetchCachedWidget<T>(id);
+  int node = -1;
+  T* slider = fetchCachedWidget<T>(id,&node);
 
   if (slider==0)
   {
-    slider = new T();
+    if (deferCreation()) return false;
+    
+    slider = recycledWidget<T>();
+    if (slider==0) slider = new T();
     slider->setOrientation((Qt::Orientation)orientation);
-    initializeWidget(id,slider,*opts.opts);
+    node = initializeWidget(id,slider,*opts.opts);
   }
   
-  finalizeWidget(slider,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
         
-  // TODO (min<=max)
-  // TODO (max-min) != 0 !
-  slider->setRange(0,10000);
-    
   float defaultPageStep = (max-min)/10.0f;
   
   // TODO pageStep > 0
-  int intPageStep = (int)ceil((opts.opts->get<float>("floatPageStep",defaultPageStep) / (max-min))*10000.0f);
+  int intPageStep = (int)ceil((opts.opts->get<float>(OptFloatPageStep,defaultPageStep) / (max-min))*10000.0f);
   // TODO intSingleStep
   
-  slider->setPageStep(intPageStep);
+  int range[3] = { 0, 10000, intPageStep };
+  
+  if (shadowChanged(nodeTable.appliedOpts(node).range,range,sizeof(range)))
+  {
+    // TODO (min<=max)
+    // TODO (max-min) != 0 !
+    slider->setRange(0,10000);
+    slider->setPageStep(intPageStep);
+  }
 
   int intValue = (int)round( (((*value)-min)/(max-min))*10000.0f );
   
@@ -1116,94 +2576,445 @@ bool VScrollBar(int id,float min,float max,float* value,const Opts& opts)
   return AbstractFloatSlider<IMScrollBar,Qt::Vertical>(id,min,max,value,opts);
 }
 
-bool SpinBox(int id,int min,int max,int* value,const Opts& opts)
+bool SpinBox(int id,int min,int max,int* value,const Opts& opts)
+{
+  int node = -1;
+  IMSpinBox* spinBox = fetchCachedWidget<IMSpinBox>(id,&node);
+
+  if (spinBox==0)
+  {
+    if (deferCreation()) return false;
+    
+    spinBox = recycledWidget<IMSpinBox>();
+    if (spinBox==0) spinBox = new IMSpinBox();
+    node = initializeWidget(id,spinBox,*opts.opts);
+  }
+  
+  finalizeWidget(node,*opts.opts);  
+  
+  int range[2] = { min, max };
+  
+  if (shadowChanged(nodeTable.appliedOpts(node).range,range,sizeof(range))) spinBox->setRange(min,max);
+  
+  if (spinBox->value()!=*value && spinBox->isHot()==false) spinBox->setValue(*value);
+  
+  *value = spinBox->value();
+  
+  return spinBox->spinBoxValueHasChanged;      
+}
+
+bool SpinBox(int id,float min,float max,float* value,const Opts& opts)
+{
+  int node = -1;
+  IMDoubleSpinBox* spinBox = fetchCachedWidget<IMDoubleSpinBox>(id,&node);
+
+  if (spinBox==0)
+  {
+    if (deferCreation()) return false;
+    
+    spinBox = recycledWidget<IMDoubleSpinBox>();
+    if (spinBox==0) spinBox = new IMDoubleSpinBox();
+    node = initializeWidget(id,spinBox,*opts.opts);
+  }
+  
+  finalizeWidget(node,*opts.opts);  
+  
+  float range[2] = { min, max };
+  
+  if (shadowChanged(nodeTable.appliedOpts(node).range,range,sizeof(range))) spinBox->setRange(min,max);
+  
+  if (spinBox->value()!=*value && spinBox->isHot()==false) spinBox->setValue(*value);
+  
+  *value = spinBox->value();
+  
+  return spinBox->spinBoxValueHasChanged;      
+}
+
+bool LineEdit(int id,int* value,const Opts& opts)
+{
+  int node = -1;
+  IMLineEdit* lineEdit = fetchCachedWidget<IMLineEdit>(id,&node);
+
+  if (lineEdit==0)
+  {
+    if (deferCreation()) return false;
+    
+    lineEdit = recycledWidget<IMLineEdit>();
+    if (lineEdit==0) lineEdit = new IMLineEdit();
+    if (qobject_cast<const QIntValidator*>(lineEdit->validator())==0) lineEdit->setValidator(new QIntValidator(lineEdit));
+    node = initializeWidget(id,lineEdit,*opts.opts);
+  }
+  
+  finalizeWidget(node,*opts.opts);  
+    
+  AppliedOpts& applied = nodeTable.appliedOpts(node);
+  
+  // the user may have typed another spelling of the same value
+  if (lineEdit->lineEditValueHasChanged) applied.value = Shadow();
+  
+  if (lineEdit->isHot()==false && shadowChanged(applied.value,value,sizeof(*value))) lineEdit->setText(QString().setNum(*value));
+  
+  *value = lineEdit->text().toInt();
+  
+  return lineEdit->lineEditValueHasChanged;      
+}
+
+bool LineEdit(int id,float* value,const Opts& opts)
+{
+  int node = -1;
+  IMLineEdit* lineEdit = fetchCachedWidget<IMLineEdit>(id,&node);
+
+  if (lineEdit==0)
+  {
+    if (deferCreation()) return false;
+    
+    lineEdit = recycledWidget<IMLineEdit>();
+    if (lineEdit==0) lineEdit = new IMLineEdit();
+    if (qobject_cast<const QDoubleValidator*>(lineEdit->validator())==0) lineEdit->setValidator(new QDoubleValidator(lineEdit));
+    node = initializeWidget(id,lineEdit,*opts.opts);
+  }
+  
+  finalizeWidget(node,*opts.opts);  
+    
+  AppliedOpts& applied = nodeTable.appliedOpts(node);
+  
+  // the user may have typed another spelling of the same value
+  if (lineEdit->lineEditValueHasChanged) applied.value = Shadow();
+  
+  if (lineEdit->isHot()==false && shadowChanged(applied.value,value,sizeof(*value))) lineEdit->setText(QString().setNum(*value,'f'));
+  
+  *value = lineEdit->text().toFloat();
+  
+  return lineEdit->lineEditValueHasChanged;      
+}
+
+// Retained bindings. The bound widget is declared once and then kept alive by syncBindings(), it lives
+// as long as the layout it was declared into.
+enum BindingKind
+{
+  BindingSlider,
+  BindingSpinBox,
+  BindingCheckBox
+};
+
+struct Binding
+{
+  quint64 uid;
+  BindingKind kind;
+  int node;
+  QObject* object;
+  int layoutNode;
+  QObject* layout;
+  void* value;
+  float min;
+  float max;
+  float lastWidgetValue;  // value of the widget as it was at the last sync
+};
+
+QVector<Binding> bindings;
+QVector<float> boundValues;  // *value of each binding as it was at the last sync, in the order of bindings
+QVector<float> currentValues;
+QHash<quint64,int> bindingIndices;
+QHash<int,int> bindingNodes;     // node of the bound widget -> binding
+QHash<QObject*,int> boundItems;  // bound widget -> its node
+
+void removeBinding(int i)
+{
+  bindingIndices.remove(bindings[i].uid);
+  bindingNodes.remove(bindings[i].node);
+  boundItems.remove(bindings[i].object);
+  
+  if (i!=bindings.size()-1)
+  {
+    bindings[i] = bindings.last();
+    boundValues[i] = boundValues.last();
+    bindingIndices[bindings[i].uid] = i;
+    bindingNodes[bindings[i].node] = i;
+  }
+  
+  bindings.pop_back();
+  boundValues.pop_back();
+}
+
+float boundValue(const Binding& binding)
+{
+  if (binding.kind==BindingCheckBox) return *((bool*)binding.value) ? 1.0f : 0.0f;
+  
+  return *((float*)binding.value);
+}
+
+float widgetValue(const Binding& binding)
+{
+  switch(binding.kind)
+  {
+    case BindingSlider:   return (float)((IMSlider*)binding.object)->value();
+    case BindingSpinBox:  return (float)((IMDoubleSpinBox*)binding.object)->value();
+    case BindingCheckBox: return ((IMCheckBox*)binding.object)->isChecked() ? 1.0f : 0.0f;
+  }
+  
+  return 0.0f;
+}
+
+bool widgetIsHot(const Binding& binding)
+{
+  switch(binding.kind)
+  {
+    case BindingSlider:   return ((IMSlider*)binding.object)->isHot();
+    case BindingSpinBox:  return ((IMDoubleSpinBox*)binding.object)->isHot();
+    case BindingCheckBox: return ((IMCheckBox*)binding.object)->isHot();
+  }
+  
+  return false;
+}
+
+// Synchronizes all bound widgets with their variables in one pass. Changes made by the user come from the
+// changed widgets only, changes made by the program are found by gathering the variables into one array and
+// comparing it with the last sync at once. Changes made by the user win over changes made by the program.
+void syncBindings()
+{
+  for(int i=0;i<bindings.size();)
+  {
+    const Binding& binding = bindings[i];
+    
+    const Node& node = nodeTable[binding.node];
+    const Node& layoutNode = nodeTable[binding.layoutNode];
+    
+    bool alive = (node.object==binding.object && layoutNode.object==binding.layout &&
+                  (layoutNode.generation==frameGeneration || keptByCache(layoutNode.block)));
+    
+    if (!alive) { removeBinding(i); continue; }
+    
+    // bound widgets in grid layouts are not declared by declareBoundItems()
+    refresh(binding.node);
+    
+    i++;
+  }
+  
+  int count = bindings.size();
+  
+  if (count==0) return;
+  
+  for(int i=0;i<changedWidgets.size();i++)
+  {
+    QHash<int,int>::const_iterator it = bindingNodes.constFind(changedWidgets[i]->node);
+    
+    if (it==bindingNodes.constEnd()) continue;
+    
+    Binding& binding = bindings[it.value()];
+    float current = widgetValue(binding);
+    
+    if (current==binding.lastWidgetValue) continue;
+    
+    switch(binding.kind)
+    {
+      case BindingSlider:   *((float*)binding.value) = (current/10000.0f)*(binding.max-binding.min)+binding.min; break;
+      case BindingSpinBox:  *((float*)binding.value) = current; break;
+      case BindingCheckBox: *((bool*)binding.value) = (current!=0.0f); break;
+    }
+    
+    binding.lastWidgetValue = current;
+    boundValues[it.value()] = boundValue(binding);
+    
+    frameStats.bindingsSynced++;
+  }
+  
+  currentValues.resize(count);
+  
+  for(int i=0;i<count;i++) currentValues[i] = boundValue(bindings[i]);
+  
+  if (memcmp(currentValues.constData(),boundValues.constData(),count*sizeof(float))==0) return;
+  
+  for(int i=0;i<count;i++)
+  {
+    float value = currentValues[i];
+    
+    if (memcmp(&value,&boundValues[i],sizeof(float))==0) continue;
+    
+    Binding& binding = bindings[i];
+    
+    // pushed once the user lets go of the widget
+    if (widgetIsHot(binding)) continue;
+    
+    switch(binding.kind)
+    {
+      case BindingSlider:   ((IMSlider*)binding.object)->setValue((int)round(((value-binding.min)/(binding.max-binding.min))*10000.0f)); break;
+      case BindingSpinBox:  ((IMDoubleSpinBox*)binding.object)->setValue(value); break;
+      case BindingCheckBox: ((IMCheckBox*)binding.object)->setChecked(value!=0.0f); break;
+    }
+    
+    boundValues[i] = value;
+    binding.lastWidgetValue = widgetValue(binding);
+    
+    frameStats.bindingsSynced++;
+  }
+}
+
+// Declares the widget through the immediate mode function, which is never deferred here
+// because the binding is registered only once, and records the binding.
+void bindWidget(int id,BindingKind kind,void* value,float min,float max)
 {
-  IMSpinBox* spinBox = fetchCachedWidget<IMSpinBox>(id);
-
-  if (spinBox==0)
-  {
-    spinBox = new IMSpinBox();
-    initializeWidget(id,spinBox,*opts.opts);
-  }
+  quint64 uid = scopedId(id);
   
-  finalizeWidget(spinBox,*opts.opts);  
+  int node = nodeTable.find(uid,false);
+  assert(node!=-1);
   
-  spinBox->setRange(min,max);
+  QLayout* layout = layoutStack.top();
+  assert(layout!=0);
   
-  if (spinBox->value()!=*value && spinBox->isHot()==false) spinBox->setValue(*value);
+  Binding binding;
+  binding.uid = uid;
+  binding.kind = kind;
+  binding.node = node;
+  binding.object = nodeTable[node].object;
+  binding.layoutNode = nodeTable.nodeOf(layout);
+  binding.layout = layout;
+  binding.value = value;
+  binding.min = min;
+  binding.max = max;
+  binding.lastWidgetValue = widgetValue(binding);
   
-  *value = spinBox->value();
+  QHash<quint64,int>::const_iterator it = bindingIndices.constFind(uid);
   
-  return spinBox->spinBoxValueHasChanged;      
+  int i;
+  
+  if (it!=bindingIndices.constEnd())
+  {
+    i = it.value();
+    
+    bindingNodes.remove(bindings[i].node);
+    boundItems.remove(bindings[i].object);
+    
+    bindings[i] = binding;
+    boundValues[i] = boundValue(binding);
+  }
+  else
+  {
+    i = bindings.size();
+    
+    bindingIndices[uid] = i;
+    bindings.push_back(binding);
+    boundValues.push_back(boundValue(binding));
+  }
+  
+  bindingNodes[node] = i;
+  boundItems[binding.object] = node;
 }
 
-bool SpinBox(int id,float min,float max,float* value,const Opts& opts)
+// Bound widgets are not declared by the program. In box layouts they are declared in its stead when the
+// declarations reach their place, so that they keep their position among the declared items. uid is the
+// object being declared, which stops the walk even when it is bound.
+void declareBoundItems(quint64 uid)
 {
-  IMDoubleSpinBox* spinBox = fetchCachedWidget<IMDoubleSpinBox>(id);
-
-  if (spinBox==0)
+  if (boundItems.isEmpty() || layoutStack.isEmpty()) return;
+  
+  int depth = layoutStack.size()-1;
+  
+  if (layoutStack.top()==0 || depth>=boxFrames.size() || boxFrames[depth].layout!=layoutStack.top()) return;
+  
+  QBoxLayout* layout = boxFrames[depth].layout;
+  
+  while (orderStack.top()<layout->count())
   {
-    spinBox = new IMDoubleSpinBox();
-    initializeWidget(id,spinBox,*opts.opts);
+    QWidget* widget = layout->itemAt(orderStack.top())->widget();
+    QHash<QObject*,int>::const_iterator it = boundItems.constFind(widget);
+    
+    if (it==boundItems.constEnd()) return;
+    
+    Node& node = nodeTable[it.value()];
+    
+    if (node.object!=widget || node.uid==uid || declaredThisFrame(node)) return;
+    
+    refresh(it.value());
+    declareItem(it.value());
+    
+    orderStack.top() = orderStack.top()+1;
   }
+}
+
+// Called by *LayoutEnd(), declares the bound widgets left after the last declared item.
+void declareRemainingBoundItems()
+{
+  if (boundItems.isEmpty()) return;
   
-  finalizeWidget(spinBox,*opts.opts);  
-  
-  spinBox->setRange(min,max);
+  int depth = layoutStack.size()-1;
   
-  if (spinBox->value()!=*value && spinBox->isHot()==false) spinBox->setValue(*value);
+  if (boxFrames[depth].layout!=layoutStack.top()) return;
   
-  *value = spinBox->value();
+  QBoxLayout* layout = boxFrames[depth].layout;
   
-  return spinBox->spinBoxValueHasChanged;      
+  for(int i=orderStack.top();i<layout->count();i++)
+  {
+    QWidget* widget = layout->itemAt(i)->widget();
+    QHash<QObject*,int>::const_iterator it = boundItems.constFind(widget);
+    
+    if (it==boundItems.constEnd()) continue;
+    
+    Node& node = nodeTable[it.value()];
+    
+    if (node.object!=widget || declaredThisFrame(node)) continue;
+    
+    refresh(it.value());
+    declareItem(it.value());
+    
+    orderStack.top() = orderStack.top()+1;
+  }
 }
 
-bool LineEdit(int id,int* value,const Opts& opts)
+void BindSlider(int id,float min,float max,float* value,const Opts& opts)
 {
-  IMLineEdit* lineEdit = fetchCachedWidget<IMLineEdit>(id);
-
-  if (lineEdit==0)
+  int budget = creationBudget;
+  creationBudget = 0;
+  
+  if (opts.opts->get<int>(OptOrientation,OrientationHorizontal)==OrientationVertical)
   {
-    lineEdit = new IMLineEdit();
-    lineEdit->setValidator(new QIntValidator());
-    initializeWidget(id,lineEdit,*opts.opts);
+    AbstractFloatSlider<IMSlider,Qt::Vertical>(id,min,max,value,opts);
+  }
+  else
+  {
+    AbstractFloatSlider<IMSlider,Qt::Horizontal>(id,min,max,value,opts);
   }
   
-  finalizeWidget(lineEdit,*opts.opts);  
-    
-  if (lineEdit->isHot()==false) lineEdit->setText(QString().setNum(*value));
-  
-  *value = lineEdit->text().toInt();
+  creationBudget = budget;
   
-  return lineEdit->lineEditValueHasChanged;      
+  bindWidget(id,BindingSlider,value,min,max);
 }
 
-bool LineEdit(int id,float* value,const Opts& opts)
+void BindSpinBox(int id,float min,float max,float* value,const Opts& opts)
 {
-  IMLineEdit* lineEdit = fetchCachedWidget<IMLineEdit>(id);
-
-  if (lineEdit==0)
-  {
-    lineEdit = new IMLineEdit();    
-    lineEdit->setValidator(new QDoubleValidator(0));
-    initializeWidget(id,lineEdit,*opts.opts);
-  }
+  int budget = creationBudget;
+  creationBudget = 0;
+  SpinBox(id,min,max,value,opts);
+  creationBudget = budget;
   
-  finalizeWidget(lineEdit,*opts.opts);  
-    
-  if (lineEdit->isHot()==false) lineEdit->setText(QString().setNum(*value,'f'));
+  bindWidget(id,BindingSpinBox,value,min,max);
+}
+
+void BindCheckBox(int id,const char* text,bool* state,const Opts& opts)
+{
+  int budget = creationBudget;
+  creationBudget = 0;
+  CheckBox(id,text,state,opts);
+  creationBudget = budget;
   
-  *value = lineEdit->text().toFloat();
+  bindWidget(id,BindingCheckBox,state,0.0f,1.0f);
+}
+
+void Unbind(int id)
+{
+  QHash<quint64,int>::const_iterator it = bindingIndices.constFind(scopedId(id));
   
-  return lineEdit->lineEditValueHasChanged;      
+  if (it!=bindingIndices.constEnd()) removeBinding(it.value());
 }
 
 void Spacer(int id,const Opts& opts)
 {
-  QFrame* frame = fetchCachedWidget<QFrame>(id);
+  int node = -1;
+  QFrame* frame = fetchCachedWidget<QFrame>(id,&node);
   
   if (frame==0)
   {
+    if (deferCreation()) return;
+    
     frame = new QFrame();    
     
     if (QVBoxLayout* vboxLayout = qobject_cast<QVBoxLayout*>(layoutStack.top())) 
@@ -1215,78 +3026,104 @@ void Spacer(int id,const Opts& opts)
       frame->setSizePolicy(QSizePolicy::MinimumExpanding,QSizePolicy::Maximum);
     }
     
-    initializeWidget(id,frame,*opts.opts);
+    node = initializeWidget(id,frame,*opts.opts);
   }
 
-  finalizeWidget(frame,*opts.opts);  
+  finalizeWidget(node,*opts.opts);  
 }
 
 void WindowBegin(int id,const char* iconFileName,const char* title,const Opts& opts)
 {
   assert(widgetStack.empty()==true);
+  
+  if (inputPump==InputPumpAtWindowBegin || (inputPump==InputPumpAtFrameStart && !framePumped))
+  {
+    pumpInput();
+    framePumped = true;
+  }
 
-  IMWindow* window = fetchCachedWidget<IMWindow>(id);
+  int node = -1;
+  IMWindow* window = fetchCachedWidget<IMWindow>(id,&node);
   
   if(window==0)
   {
     window = new IMWindow();
 
-    initializeWidget(id,window,*opts.opts);
+    node = initializeWidget(id,window,*opts.opts);
   }
 
   ///////////////////////////////////////////////////////////////////////////////////
 
-  window->setWindowModality(opts.opts->get<bool>("modal",false) ? Qt::ApplicationModal : Qt::NonModal);
+  AppliedOpts& applied = nodeTable.appliedOpts(node);
+  
+  Qt::WindowModality modality = opts.opts->get<bool>(OptModal,false) ? Qt::ApplicationModal : Qt::NonModal;
 
   ///////////////////////////////////////////////////////////////////////////////////
   
   Qt::WindowFlags windowFlags = Qt::Window | Qt::CustomizeWindowHint;
     
-  if (opts.opts->get<bool>("showTitleBar",true))
+  if (opts.opts->get<bool>(OptShowTitleBar,true))
   {
     windowFlags |= Qt::WindowTitleHint;
     
-    if (opts.opts->get<bool>("showMinimizeButton",true)) windowFlags |= Qt::WindowMinimizeButtonHint | Qt::WindowSystemMenuHint;
-    if (opts.opts->get<bool>("showMaximizeButton",true)) windowFlags |= Qt::WindowMaximizeButtonHint | Qt::WindowSystemMenuHint;
-    if (opts.opts->get<bool>("showCloseButton",true))    windowFlags |= Qt::WindowCloseButtonHint    | Qt::WindowSystemMenuHint;
-    if (opts.opts->get<bool>("showSystemMenu",true))     windowFlags |= Qt::WindowSystemMenuHint;
+    if (opts.opts->get<bool>(OptShowMinimizeButton,true)) windowFlags |= Qt::WindowMinimizeButtonHint | Qt::WindowSystemMenuHint;
+    if (opts.opts->get<bool>(OptShowMaximizeButton,true)) windowFlags |= Qt::WindowMaximizeButtonHint | Qt::WindowSystemMenuHint;
+    if (opts.opts->get<bool>(OptShowCloseButton,true))    windowFlags |= Qt::WindowCloseButtonHint    | Qt::WindowSystemMenuHint;
+    if (opts.opts->get<bool>(OptShowSystemMenu,true))     windowFlags |= Qt::WindowSystemMenuHint;
   }
 
-  if (opts.opts->get<bool>("showFrame",true)==false && !(windowFlags & Qt::WindowSystemMenuHint))
+  if (opts.opts->get<bool>(OptShowFrame,true)==false && !(windowFlags & Qt::WindowSystemMenuHint))
   {
     windowFlags |= Qt::FramelessWindowHint;
   }
   
-  if (opts.opts->get<bool>("stayOnTop",false)) windowFlags |= Qt::WindowStaysOnTopHint;
+  if (opts.opts->get<bool>(OptStayOnTop,false)) windowFlags |= Qt::WindowStaysOnTopHint;
     
-  window->setWindowFlags(windowFlags);
+  // setWindowFlags() recreates and hides the window even when the flags are the same
+  int windowState[2] = { (int)windowFlags, (int)modality };
+  
+  if (shadowChanged(applied.window,windowState,sizeof(windowState)))
+  {
+    window->setWindowModality(modality);
+    window->setWindowFlags(windowFlags);
+  }
 
   ///////////////////////////////////////////////////////////////////////////////////
 
   // XXX:
-  if (!window->isVisible() && opts.opts->isSet("initialGeometryX"))
+  if (!window->isVisible() && opts.opts->isSet(OptInitialGeometryX))
   {
-    window->setGeometry(opts.opts->get<int>("initialGeometryX"),
-                        opts.opts->get<int>("initialGeometryY"),
-                        opts.opts->get<int>("initialGeometryWidth"),
-                        opts.opts->get<int>("initialGeometryHeight"));
+    window->setGeometry(opts.opts->get<int>(OptInitialGeometryX),
+                        opts.opts->get<int>(OptInitialGeometryY),
+                        opts.opts->get<int>(OptInitialGeometryWidth),
+                        opts.opts->get<int>(OptInitialGeometryHeight));
   }
 
+  ///////////////////////////////////////////////////////////////////////////////////
+  
+  if (window->layout()!=0 && window->layout()->isEnabled())
+  {
+    window->layout()->setEnabled(false);
+    touchedWindows.push_back(window);
+  }
+  
   ///////////////////////////////////////////////////////////////////////////////////
     
-  window->setWindowTitle(title);
+  if (shadowChanged(applied.text,title)) window->setWindowTitle(title);
 
   //window->show();
   // XXX: HACK!
   showlist.push_back(window);
   
-  if (QString(iconFileName).isEmpty()==false) window->setWindowIcon(QIcon(iconFileName));
+  if (QString(iconFileName).isEmpty()==false && shadowChanged(applied.icon,iconFileName)) window->setWindowIcon(QIcon(iconFileName));
   
-  finalizeWidget(window,*opts.opts);
+  finalizeWidget(node,*opts.opts);
 
   layoutStack.push(0);  
   orderStack.push(0);
   widgetStack.push(window);    
+  inputStack.push(0);
+  idStack.push(scopedId(id));
 }
 
 void WindowBegin(int id,const char* title,const Opts& opts)
@@ -1301,6 +3138,8 @@ void WindowEnd()
   layoutStack.pop();
   orderStack.pop();
   widgetStack.pop();
+  inputStack.pop();
+  idStack.pop();
 
   assert(widgetStack.empty()==true);
 }
@@ -1328,20 +3167,22 @@ void lower()
 
 void FrameBegin(int id,const Opts& opts)
 {
-  IMFrame* frame = fetchCachedWidget<IMFrame>(id);
+  int node = -1;
+  IMFrame* frame = fetchCachedWidget<IMFrame>(id,&node);
 
   if (frame==0)
   {
     frame = new IMFrame();
     
-    initializeWidget(id,frame,*opts.opts);
+    node = initializeWidget(id,frame,*opts.opts);
   }
   
-  finalizeWidget(frame,*opts.opts);
+  finalizeWidget(node,*opts.opts);
 
   layoutStack.push(0);  
   orderStack.push(0);
   widgetStack.push(frame);
+  inputStack.push(&frame->input);
 }
 
 void FrameEnd()
@@ -1349,26 +3190,30 @@ void FrameEnd()
   layoutStack.pop();
   orderStack.pop();
   widgetStack.pop();
+  inputStack.pop();
 }
 
 void GroupBoxBegin(int id,const char* text,const Opts& opts)
 {
-  QGroupBox* groupBox = fetchCachedWidget<QGroupBox>(id);
+  int node = -1;
+  QGroupBox* groupBox = fetchCachedWidget<QGroupBox>(id,&node);
 
   if (groupBox==0)
   {
     groupBox = new QGroupBox(text);
     
-    initializeWidget(id,groupBox,*opts.opts);
+    node = initializeWidget(id,groupBox,*opts.opts);
   }
   
-  groupBox->setTitle(text);
+  if (shadowChanged(nodeTable.appliedOpts(node).text,text)) groupBox->setTitle(text);
 
-  finalizeWidget(groupBox,*opts.opts);
+  finalizeWidget(node,*opts.opts);
 
   layoutStack.push(0);  
   orderStack.push(0);
   widgetStack.push(groupBox);
+  inputStack.push(0);
+  idStack.push(scopedId(id));
 }
 
 void GroupBoxEnd()
@@ -1376,79 +3221,362 @@ void GroupBoxEnd()
   layoutStack.pop();
   orderStack.pop();
   widgetStack.pop();
+  inputStack.pop();
+  idStack.pop();
+}
+
+void PushID(int id)
+{
+  idStack.push(scopedId(id));
+}
+
+void PushID(const char* str)
+{
+  assert(str!=0);
+  
+  // FNV-1a seeded with the enclosing scope
+  quint64 h = Q_UINT64_C(0xcbf29ce484222325) ^ (idStack.isEmpty() ? 0 : idStack.top());
+  
+  for(const char* c=str;*c!=0;c++)
+  {
+    h ^= (uchar)*c;
+    h *= Q_UINT64_C(0x100000001b3);
+  }
+  
+  idStack.push(mixId(h,0));
+}
+
+unsigned long long GetID(int id)
+{
+  return scopedId(id);
+}
+
+void PopID()
+{
+  assert(idStack.empty()==false);
+  
+  idStack.pop();
+}
+
+void setPixmapView(IMPixmap* pixmap,const Opts& opts)
+{
+  float zoom = opts.opts->get<float>(OptZoom,1.0f);
+  assert(zoom>0.0f);
+  
+  pixmap->setView(zoom,
+                  opts.opts->get<float>(OptPanX,0.0f),
+                  opts.opts->get<float>(OptPanY,0.0f),
+                  opts.opts->get<int>(OptInterpolation,InterpolationBilinear)==InterpolationBilinear);
 }
 
 void PixmapBegin(int id,const Opts& opts)
 {
-  IMPixmap* pixmap = fetchCachedWidget<IMPixmap>(id);
+  int node = -1;
+  IMPixmap* pixmap = fetchCachedWidget<IMPixmap>(id,&node);
 
   if (pixmap==0)
   {
-    pixmap = new IMPixmap();
+    pixmap = new IMPixmap();
+    
+    node = initializeWidget(id,pixmap,*opts.opts);
+  }
+  
+  finalizeWidget(node,*opts.opts);
+  
+  setPixmapView(pixmap,opts);
+
+  layoutStack.push(0);  
+  orderStack.push(0);
+  widgetStack.push(pixmap);  
+  inputStack.push(&pixmap->input);
+}
+
+void PixmapEnd()
+{
+  layoutStack.pop();
+  orderStack.pop();
+  widgetStack.pop();  
+  inputStack.pop();
+}
+
+void TiledViewBegin(int id,TiledImage* image,const Opts& opts)
+{
+  int node = -1;
+  IMTiledView* view = fetchCachedWidget<IMTiledView>(id,&node);
+
+  if (view==0)
+  {
+    view = new IMTiledView();
+    
+    node = initializeWidget(id,view,*opts.opts);
+  }
+  
+  finalizeWidget(node,*opts.opts);
+  
+  setPixmapView(view,opts);
+  view->setImage(image);
+
+  layoutStack.push(0);  
+  orderStack.push(0);
+  widgetStack.push(view);  
+  inputStack.push(&view->input);
+}
+
+void TiledViewEnd()
+{
+  PixmapEnd();
+}
+
+char* FileOpenDialog(const char* caption,const char* dir,const char* filter)
+{
+  static QByteArray fileName;  
+  
+  //XXX: fileName = QFileDialog::getOpenFileName(0,caption,dir,filter).toLocal8Bit();    
+  //this is workaround for a situation when one compiles imgui with msvc2010+
+  //and links it with Qt that was built with older msvc i.e., msvc2008.
+  //The problem is that msvc2010 expects implicitly generated operator= with C++0x r-value reference,
+  //which is not present in Qt lib that was built with older version of msvc.
+  fileName.clear();
+  fileName.insert(0,QFileDialog::getOpenFileName(0,caption,dir,filter).toLocal8Bit());
+  ///////////////////////////////
+
+  if (fileName.size()==0) return 0;
+  fileName.append('\0');  
+  return fileName.data();
+}
+
+char* FileSaveDialog(const char* caption,const char* dir,const char* filter)
+{
+  static QByteArray fileName;
+
+  //XXX: fileName = QFileDialog::getSaveFileName(0,caption,dir,filter).toLocal8Bit();    
+  //this is workaround for a situation when one compiles imgui with msvc2010+
+  //and links it with Qt that was built with older msvc i.e., msvc2008.
+  //The problem is that msvc2010 expects implicitly generated operator= with C++0x r-value reference,
+  //which is not present in Qt lib that was built with older version of msvc.
+  fileName.clear();
+  fileName.insert(0,QFileDialog::getSaveFileName(0,caption,dir,filter).toLocal8Bit());
+  ///////////////////////////////
+
+  if (fileName.size()==0) return 0;
+  fileName.append('\0');  
+  return fileName.data();
+}
+
+void MessageDialog(const char* text)
+{
+  QMessageBox msgBox;
+  msgBox.setText(text);
+  msgBox.exec();
+}
+
+IMPixmap* currentPixmap()
+{
+  assert(widgetStack.empty()==false);
+  assert(qobject_cast<IMPixmap*>(widgetStack.top())!=0);
+  
+  return (IMPixmap*)widgetStack.top();
+}
+
+void pixmapBlit(int width,int height,const unsigned char* data)
+{
+  IMPixmap* pixmap = currentPixmap();
+  
+  pixmap->resizeBuffer(width,height);
+  pixmapBlit(0,0,width,height,data,width*4);
+}
+
+void pixmapBlit(int x,int y,int width,int height,const unsigned char* data,int stride)
+{
+  pixmapBlit(x,y,width,height,data,stride,PixmapARGB32);
+}
+
+void pixmapBlit(int width,int height,const void* data,int stride,PixmapFormat format,float low,float high)
+{
+  currentPixmap()->resizeBuffer(width,height);
+  pixmapBlit(0,0,width,height,data,stride,format,low,high);
+}
+
+void pixmapBlit(int x,int y,int width,int height,const void* data,int stride,PixmapFormat format,float low,float high)
+{
+  IMPixmap* pixmap = currentPixmap();
+  pixmap->showBuffer();
+  
+  QImage& buffer = pixmap->buffer;
+  
+  QRect rect = QRect(x,y,width,height).intersected(buffer.rect());
+  
+  if (rect.isEmpty()) return;
+  
+  ConvertSource source;
+  source.data = (const unsigned char*)data;
+  source.stride = stride;
+  source.frameHeight = height;
+  source.format = format;
+  source.low = low;
+  source.high = high;
+  
+  convertToARGB32(source,rect.x()-x,rect.y()-y,rect.width(),rect.height(),
+                  buffer.scanLine(rect.y())+rect.x()*4,buffer.bytesPerLine());
+  
+  pixmap->updateImage(rect.x(),rect.y(),rect.width(),rect.height());
+}
+
+// Triple buffer shared by one producer thread and the GUI thread. The producer owns the write buffer and
+// the GUI thread the read buffer, they trade them for the middle one with one atomic exchange each.
+struct PixmapFeed
+{
+  enum { FreshBit = 4 }; // the middle buffer holds a frame that was not taken yet
+  
+  int width;
+  int height;
+  int stride;
+  PixmapFormat format;
+  float low;
+  float high;
+  
+  unsigned char* buffers[3];
+  
+  int writeIndex;
+  int readIndex;
+  QAtomicInt middle;
+  
+  QAtomicInt published;
+  QAtomicInt displayed;
+  QAtomicInt dropped;
+};
+
+PixmapFeed* pixmapFeedCreate(int width,int height,PixmapFormat format,float low,float high)
+{
+  assert(width>0 && height>0);
+  
+  bool planar = (format==PixmapNV12 || format==PixmapYUV420);
+  
+  PixmapFeed* feed = new PixmapFeed();
+  feed->width = width;
+  feed->height = height;
+  feed->format = format;
+  feed->low = low;
+  feed->high = high;
+  
+  // rows are 4-byte aligned, the chroma rows of YUV420 take half a luma row and need (width+1)/2 bytes
+  int row = planar ? (width+1)/2*2 : width*bytesPerPixel(format);
+  feed->stride = (row+3)/4*4;
+  
+  int size = feed->stride*height;
+  
+  // NV12 interleaves U,V in rows as long as the luma rows, YUV420 has two planes of half stride
+  if (planar) size += feed->stride*((height+1)/2);
+  
+  for(int i=0;i<3;i++)
+  {
+    feed->buffers[i] = new unsigned char[size];
+    memset(feed->buffers[i],0,size);
+  }
+  
+  feed->writeIndex = 0;
+  feed->readIndex = 1;
+  feed->middle = 2;
+  
+  return feed;
+}
+
+void pixmapFeedDestroy(PixmapFeed* feed)
+{
+  if (feed==0) return;
+  
+  for(int i=0;i<3;i++) delete[] feed->buffers[i];
+  
+  delete feed;
+}
+
+unsigned char* feedAcquire(PixmapFeed* feed,int* stride)
+{
+  if (stride!=0) *stride = feed->stride;
+  
+  return feed->buffers[feed->writeIndex];
+}
+
+void feedPublish(PixmapFeed* feed)
+{
+  int previous = feed->middle.fetchAndStoreOrdered(feed->writeIndex | PixmapFeed::FreshBit);
+  
+  feed->writeIndex = previous & 3;
+  
+  feed->published.fetchAndAddRelaxed(1);
+  if (previous & PixmapFeed::FreshBit) feed->dropped.fetchAndAddRelaxed(1);
+}
+
+void pixmapFeedStats(PixmapFeed* feed,PixmapFeedStats* stats)
+{
+  assert(stats!=0);
+  
+  stats->published = feed->published;
+  stats->displayed = feed->displayed;
+  stats->dropped = feed->dropped;
+}
+
+void pixmapFeed(PixmapFeed* feed)
+{
+  IMPixmap* pixmap = currentPixmap();
+  
+  if ((feed->middle & PixmapFeed::FreshBit)==0) return;
+  
+  int previous = feed->middle.fetchAndStoreOrdered(feed->readIndex);
+  
+  feed->readIndex = previous & 3;
+  feed->displayed.fetchAndAddRelaxed(1);
+  
+  if (feed->format==PixmapARGB32 || feed->format==PixmapRGB32)
+  {
+    QImage::Format format = (feed->format==PixmapRGB32) ? QImage::Format_RGB32 : QImage::Format_ARGB32;
     
-    initializeWidget(id,pixmap,*opts.opts);
+    pixmap->showImage(QImage(feed->buffers[feed->readIndex],feed->width,feed->height,feed->stride,format));
+    return;
   }
   
-  finalizeWidget(pixmap,*opts.opts);
-
-  layoutStack.push(0);  
-  orderStack.push(0);
-  widgetStack.push(pixmap);  
+  // the read buffer stays with this thread until the next exchange
+  pixmapBlit(feed->width,feed->height,feed->buffers[feed->readIndex],feed->stride,feed->format,feed->low,feed->high);
 }
 
-void PixmapEnd()
+void pixmapViewToImage(int x,int y,float* imageX,float* imageY)
 {
-  layoutStack.pop();
-  orderStack.pop();
-  widgetStack.pop();  
+  QPointF point = currentPixmap()->viewToImage(QPointF(x,y));
+  
+  if (imageX!=0) *imageX = (float)point.x();
+  if (imageY!=0) *imageY = (float)point.y();
 }
 
-char* FileOpenDialog(const char* caption,const char* dir,const char* filter)
+void pixmapSetSize(int width,int height)
 {
-  static QByteArray fileName;  
+  assert(width>=0 && height>=0);
   
-  //XXX: fileName = QFileDialog::getOpenFileName(0,caption,dir,filter).toLocal8Bit();    
-  //this is workaround for a situation when one compiles imgui with msvc2010+
-  //and links it with Qt that was built with older msvc i.e., msvc2008.
-  //The problem is that msvc2010 expects implicitly generated operator= with C++0x r-value reference,
-  //which is not present in Qt lib that was built with older version of msvc.
-  fileName.clear();
-  fileName.insert(0,QFileDialog::getOpenFileName(0,caption,dir,filter).toLocal8Bit());
-  ///////////////////////////////
-
-  if (fileName.size()==0) return 0;
-  fileName.append('\0');  
-  return fileName.data();
+  currentPixmap()->resizeBuffer(width,height);
 }
 
-char* FileSaveDialog(const char* caption,const char* dir,const char* filter)
+void pixmapLock(unsigned char** data,int* stride)
 {
-  static QByteArray fileName;
-
-  //XXX: fileName = QFileDialog::getSaveFileName(0,caption,dir,filter).toLocal8Bit();    
-  //this is workaround for a situation when one compiles imgui with msvc2010+
-  //and links it with Qt that was built with older msvc i.e., msvc2008.
-  //The problem is that msvc2010 expects implicitly generated operator= with C++0x r-value reference,
-  //which is not present in Qt lib that was built with older version of msvc.
-  fileName.clear();
-  fileName.insert(0,QFileDialog::getSaveFileName(0,caption,dir,filter).toLocal8Bit());
-  ///////////////////////////////
-
-  if (fileName.size()==0) return 0;
-  fileName.append('\0');  
-  return fileName.data();
+  IMPixmap* pixmap = currentPixmap();
+  pixmap->showBuffer();
+  
+  QImage& buffer = pixmap->buffer;
+  
+  assert(buffer.isNull()==false);
+  
+  *data = buffer.bits();
+  *stride = buffer.bytesPerLine();
 }
 
-void MessageDialog(const char* text)
+void pixmapUnlock(int x,int y,int width,int height)
 {
-  QMessageBox msgBox;
-  msgBox.setText(text);
-  msgBox.exec();
+  currentPixmap()->updateImage(x,y,width,height);
 }
 
-void pixmapBlit(int width,int height,const unsigned char* data)
+void pixmapUnlock()
 {
-  ((IMPixmap*)widgetStack.top())->setPixmap(QPixmap::fromImage(QImage(data,width,height,QImage::Format_ARGB32)));  
+  IMPixmap* pixmap = currentPixmap();
+  
+  pixmap->updateImage(0,0,pixmap->buffer.width(),pixmap->buffer.height());
 }
 
 int widgetWidth()
@@ -1465,8 +3593,8 @@ int widgetHeight()
 
 bool widgetResized(int* width,int* height)
 {
-  bool resized = false;
-  QMetaObject::invokeMethod(widgetStack.top(),"widgetResized",Qt::DirectConnection,Q_RETURN_ARG(bool,resized));  
+  IMInputState* input = inputStack.top();
+  bool resized = (input!=0 && input->widgetWasResized);
   if (width!=0) *width = widgetWidth();  
   if (height!=0) *height = widgetHeight();
   return resized;
@@ -1474,40 +3602,129 @@ bool widgetResized(int* width,int* height)
 
 bool mouseDown(MouseButton button)
 {  
-  bool down = false;
-  QMetaObject::invokeMethod(widgetStack.top(),"mouseDown",Qt::DirectConnection,Q_RETURN_ARG(bool,down),Q_ARG(int,button));  
-  return down;
+  IMInputState* input = inputStack.top();
+  return (input!=0 && input->buttonState(button)==IMInputState::Down);
 }
 
 bool mousePressed(MouseButton button)
 {
-  bool pressed = false;
-  QMetaObject::invokeMethod(widgetStack.top(),"mousePressed",Qt::DirectConnection,Q_RETURN_ARG(bool,pressed),Q_ARG(int,button));  
-  return pressed;
+  IMInputState* input = inputStack.top();
+  return (input!=0 && input->buttonState(button)==IMInputState::Pressed);
 }
 
 bool mouseUp(MouseButton button)
 {
-  bool up = false;
-  QMetaObject::invokeMethod(widgetStack.top(),"mouseUp",Qt::DirectConnection,Q_RETURN_ARG(bool,up),Q_ARG(int,button));  
-  return up;
+  IMInputState* input = inputStack.top();
+  return (input!=0 && input->buttonState(button)==IMInputState::Up);
+}
+
+// Maps a global position into widget coordinates using only the cached window geometry,
+// unlike QWidget::mapFromGlobal it never asks the window system.
+QPoint mapFromGlobalCached(QWidget* widget,const QPoint& globalPos)
+{
+  QWidget* window = widget->window();
+  QPoint windowPos = globalPos - window->geometry().topLeft();
+  
+  return (widget==window) ? windowPos : widget->mapFrom(window,windowPos);
+}
+
+// pointer position captured from the last mouse event, relative to the current widget
+QPoint mousePos()
+{
+  assert(widgetStack.top()!=0);
+  
+  if (!inputCapture->mousePosValid)
+  {
+    // no mouse event arrived yet, ask once
+    inputCapture->mouseGlobalPos = QCursor::pos();
+    inputCapture->mousePosValid = true;
+  }
+  
+  return mapFromGlobalCached(widgetStack.top(),inputCapture->mouseGlobalPos);
 }
 
 int mouseX()
 {
-  return widgetStack.top()->mapFromGlobal(QCursor::pos()).x();
+  return mousePos().x();
 }
 
 int mouseY()
 {
-  return widgetStack.top()->mapFromGlobal(QCursor::pos()).y();
+  return mousePos().y();
+}
+
+const MouseMotion* mouseMotion(int* count)
+{
+  assert(count!=0);
+  assert(widgetStack.top()!=0);
+  
+  static QVector<MouseMotion> motion;
+  
+  inputCapture->queried = true;
+  
+  const QVector<IMInputCapture::Event>& events = inputCapture->events;
+  
+  motion.clear();
+  
+  for(int i=0;i<events.size();i++)
+  {
+    if (events[i].type!=InputMouseMove) continue;
+    
+    QPoint pos = mapFromGlobalCached(widgetStack.top(),events[i].globalPos);
+    
+    MouseMotion sample;
+    sample.x = pos.x();
+    sample.y = pos.y();
+    sample.buttons = events[i].buttons;
+    sample.time = events[i].time;
+    motion.push_back(sample);
+  }
+  
+  *count = motion.size();
+  
+  return motion.data();
 }
 
 int mouseWheelDelta()
 {
-  int d = 0;
-  QMetaObject::invokeMethod(widgetStack.top(),"mouseWheelDelta",Qt::DirectConnection,Q_RETURN_ARG(int,d));  
-  return d;
+  IMInputState* input = inputStack.top();
+  return (input!=0) ? input->wheelDelta : 0;
+}
+
+void mouseState(MouseState* state)
+{
+  assert(state!=0);
+  assert(widgetStack.top()!=0);
+  
+  QPoint pos = mousePos();
+  
+  state->x = pos.x();
+  state->y = pos.y();
+  state->down = 0;
+  state->pressed = 0;
+  state->up = 0;
+  state->wheelDelta = 0;
+  state->resized = false;
+  state->width = widgetWidth();
+  state->height = widgetHeight();
+  
+  IMInputState* input = inputStack.top();
+  
+  if (input==0) return;
+  
+  const MouseButton buttons[3] = { ButtonLeft, ButtonRight, ButtonMiddle };
+  
+  for(int i=0;i<3;i++)
+  {
+    IMInputState::ButtonState buttonState = input->buttonState(buttons[i]);
+    
+    if (buttonState==IMInputState::Down) state->down |= buttons[i];
+    else if (buttonState==IMInputState::Pressed) state->pressed |= buttons[i];
+    else if (buttonState==IMInputState::Up) state->up |= buttons[i];
+  }
+  
+  state->wheelDelta = input->wheelDelta;
+  state->resized = input->widgetWasResized;
 }
 
 bool mouseIsOver()
@@ -1517,17 +3734,51 @@ bool mouseIsOver()
 
 bool keyDown(Key key)
 {
-  return eventFilter->keyDown((Qt::Key)key);
+  inputCapture->queried = true;
+  return inputCapture->keyDown((Qt::Key)key);
 }
 
 bool keyPressed(Key key)
 {
-  return eventFilter->keyPressed((Qt::Key)key);
+  inputCapture->queried = true;
+  return inputCapture->keyPressed((Qt::Key)key);
 }
 
 bool keyUp(Key key)
 {
-  return eventFilter->keyUp((Qt::Key)key);    
+  inputCapture->queried = true;
+  return inputCapture->keyUp((Qt::Key)key);    
+}
+
+const InputEvent* inputEvents(int* count)
+{
+  assert(count!=0);
+  
+  static QVector<InputEvent> stream;
+  
+  inputCapture->queried = true;
+  
+  const QVector<IMInputCapture::Event>& events = inputCapture->events;
+  
+  stream.resize(events.size());
+  
+  for(int i=0;i<events.size();i++)
+  {
+    QPoint pos = widgetStack.isEmpty() ? events[i].globalPos : mapFromGlobalCached(widgetStack.top(),events[i].globalPos);
+    
+    stream[i].type = (InputEventType)events[i].type;
+    stream[i].key = events[i].key;
+    stream[i].text = events[i].text;
+    stream[i].x = pos.x();
+    stream[i].y = pos.y();
+    stream[i].buttons = events[i].buttons;
+    stream[i].delta = events[i].delta;
+    stream[i].time = events[i].time;
+  }
+  
+  *count = stream.size();
+  
+  return stream.data();
 }
 
 bool widgetHasFocus()
@@ -1538,8 +3789,10 @@ bool widgetHasFocus()
 void guiInit(int& argc,char** argv)
 {
   app = new QApplication(argc,argv);
-  eventFilter = new IMEventFilter();
-  app->installEventFilter(eventFilter);
+  inputCapture = new IMInputCapture();
+  app->installEventFilter(inputCapture);
+  
+  latencyClock.start();
 }
 
 void guiInit()
@@ -1549,64 +3802,164 @@ void guiInit()
   guiInit(argc,&argv);
 }
 
-void guiUpdate(bool wait)
+// Brings the geometry of the frame up to date in one pass. Top layouts of widgets are activated
+// in reverse declaration order, children before their parents, so no parent has to be redone
+// after a child settles, and the LayoutRequests posted while building the frame find nothing to do.
+void activateLayouts()
+{
+  for(int i=0;i<touchedWindows.size();i++)
+  {
+    if (touchedWindows[i]->layout()!=0) touchedWindows[i]->layout()->setEnabled(true);
+  }
+  
+  touchedWindows.clear();
+  
+  for(int index=nodeTable.last(NodeTable::StaleLayouts);index!=NodeTable::StaleLayouts;index=nodeTable[index].prev)
+  {
+    const Node& node = nodeTable[index];
+    
+    if (node.parentLayout!=0) continue;
+    
+    if (((QLayout*)node.object)->activate()) frameStats.layoutActivations++;
+  }
+}
+
+// Windows invalidated by guiInvalidate(), possibly from other threads. They are taken over by the GUI thread
+// at the end of guiUpdate() and in guiWaitForInvalidation() and stay invalidated until the next guiUpdate().
+QMutex invalidationMutex;
+QVector<int> pendingInvalidations;
+QVector<int> invalidatedWindows;
+
+bool takeInvalidations()
+{
+  QMutexLocker locker(&invalidationMutex);
+  
+  for(int i=0;i<pendingInvalidations.size();i++)
+  {
+    if (!invalidatedWindows.contains(pendingInvalidations[i])) invalidatedWindows.push_back(pendingInvalidations[i]);
+  }
+  
+  pendingInvalidations.clear();
+  
+  return !invalidatedWindows.isEmpty();
+}
+
+// Display-rate mode: guiUpdate() pumps input on every call but builds a full frame only once per display
+// period. Whether the frame being built is a full one is decided at the end of the previous guiUpdate(),
+// so guiTimeToSync() and guiUpdate() never disagree.
+int displayRate = 0; // full frames per second, 0 means every frame is full
+qint64 displayPeriod = 0; // ns
+qint64 nextSync = 0;
+bool syncFrame = true;
+QElapsedTimer displayClock;
+
+void scheduleSync(bool synced)
+{
+  if (displayRate==0) { syncFrame = true; return; }
+  
+  qint64 now = displayClock.nsecsElapsed();
+  
+  if (synced)
+  {
+    // deadlines stay on the display grid unless the loop fell a whole period behind
+    nextSync += displayPeriod;
+    if (nextSync<=now) nextSync = now+displayPeriod;
+  }
+  
+  syncFrame = (now>=nextSync);
+}
+
+bool guiUpdate(bool wait)
 { 
   assert(widgetStack.empty()==true);
   assert(layoutStack.empty()==true);
   assert(orderStack.empty()==true);
+  assert(inputStack.empty()==true);
+  assert(idStack.empty()==true);
+  assert(cacheStack.empty()==true);
   
-  eventFilter->updateState();
-  
-  QVector<int> remlist;
-
-  QHashIterator<int,QWidget*> it(widgets);
-  
-  while (it.hasNext()) 
+  // Nothing was declared between two syncs, only the pending input is dispatched. The frame state is not
+  // reset: key edges and the event stream accumulate until the next full frame, like the button states of
+  // the widgets the input went to, which can't be queried before they are declared again.
+  if (!syncFrame && nodeTable.isEmpty(NodeTable::FreshWidgets) && nodeTable.isEmpty(NodeTable::FreshLayouts))
   {
-    it.next();
+    // activity tells whether this call received something
+    inputCapture->activity = false;
     
-    int id = it.key();
-    QWidget* widget = it.value();
+    // sockets wait for the full frame, and so do repaints and relayouts
+    inputCapture->holding = true;
+    if (app->hasPendingEvents()) app->processEvents(QEventLoop::ExcludeSocketNotifiers);
+    inputCapture->holding = false;
     
-    if (!fresh.contains(widget))
-    {
-      remlist.push_back(id);
-    }
-    else
-    {
-      if (widget->metaObject()->indexOfMethod("updateState()") != -1)
-      {
-        QMetaObject::invokeMethod(widget,"updateState",Qt::DirectConnection);
-      }
-    }
+    frameStats.inputUpdates++;
+    
+    scheduleSync(false);
+    
+    return inputCapture->activity || takeInvalidations();
   }
   
-  for(int i=0;i<remlist.size();i++)
+  inputCapture->updateState();
+  inputCapture->releaseHeld();
+  invalidatedWindows.clear();
+  
+  // before the changed widgets are forgotten
+  syncBindings();
+  
+  if (inputLatencyHook!=0) reportInputLatency();
+  
+  // only widgets that received input since the last frame have some state to reset
+  QVector<IMWidget*> keptWidgets;
+  
+  for(int i=0;i<dirtyWidgets.size();i++)
   {
-    deleteWidget(widgets[remlist[i]]);
+    if (lateInputWidgets.contains(dirtyWidgets[i])) { keptWidgets.push_back(dirtyWidgets[i]); continue; }
+    
+    dirtyWidgets[i]->dirty = false;
+    dirtyWidgets[i]->updateState();
   }
   
-  remlist.clear();
+  frameStats.widgetsReset += dirtyWidgets.size()-keptWidgets.size();
+  dirtyWidgets = keptWidgets;
   
-  QHashIterator<int,QLayout*> lit(layouts);
+  keptWidgets.clear();
   
-  while (lit.hasNext()) 
+  for(int i=0;i<changedWidgets.size();i++)
   {
-    lit.next();
-    int id = lit.key();
-
-    if (!fresh.contains(layouts[id]))
-    {
-      remlist.push_back(id);
-    }
+    if (lateInputWidgets.contains(changedWidgets[i])) { keptWidgets.push_back(changedWidgets[i]); continue; }
+    
+    changedWidgets[i]->changed = false;
+    changedWidgets[i]->changeTime = -1;
   }
   
-  for(int i=0;i<remlist.size();i++)
+  changedWidgets = keptWidgets;
+  
+  lateInputWidgets.clear();
+  framePumped = false;
+  
+  lateInputPending = lateInput;
+  lateInput = false;
+  
+  // whatever was not declared during this frame is gone
+  detachStaleObjects();
+  deleteDetached(teardownBudget);
+  
+  nodeTable.splice(NodeTable::StaleWidgets,NodeTable::FreshWidgets);
+  nodeTable.splice(NodeTable::StaleLayouts,NodeTable::FreshLayouts);
+  
+  // blocks that were not declared this frame lost their nodes, unless an enclosing block was skipped
+  QVector<quint64> lostBlocks;
+  
+  for(QHash<quint64,CacheBlock>::const_iterator it=cacheBlocks.constBegin();it!=cacheBlocks.constEnd();++it)
   {
-    deleteLayout(layouts[remlist[i]]);
-  } 
+    if (it.value().generation!=frameGeneration && !keptByCache(it.value().parent)) lostBlocks.push_back(it.key());
+  }
+  
+  for(int i=0;i<lostBlocks.size();i++) cacheBlocks.remove(lostBlocks[i]);
   
-  fresh.clear();    
+  frameGeneration++;
+  
+  // before showing, QWidget::show() would activate the layout of a new window on its own
+  activateLayouts();
 
   /// XXX: HACK  
   for(int i=0;i<showlist.size();i++)
@@ -1618,69 +3971,242 @@ void guiUpdate(bool wait)
   }
   showlist.clear(); 
 
+  // paint requests are coalesced into one posted UpdateRequest per window
   app->sendPostedEvents();
-  app->processEvents(QEventLoop::ExcludeUserInputEvents);
-  app->sendPostedEvents();
+  
+  frameStats.teardownPending = teardownQueue.size();
+  
+  // don't sleep on a backlog
+  if (frameStats.widgetsDeferred>0 || !teardownQueue.isEmpty()) wait = false;
   
   if (wait) app->processEvents(QEventLoop::WaitForMoreEvents); else app->processEvents();
+  
+  creationClock.invalidate();
+  
+  lastFrameStats = frameStats;
+  frameStats = GuiStats();
+  
+  bool invalidated = takeInvalidations();
+  
+  // tiles that arrived from the tile threads have to be shown
+  if (takeTileArrivals()) invalidated = true;
+  
+  scheduleSync(true);
+  
+  return inputCapture->activity || invalidated || lateInputPending;
 }
 
-void guiUpdateAndWait()
+bool guiUpdateAndWait()
 { 
-  guiUpdate(true);  
+  return guiUpdate(true);  
 }
 
-void guiCleanup()
+void guiInvalidate(int windowId)
 {
-  QVector<int> remlist;
+  {
+    QMutexLocker locker(&invalidationMutex);
+    pendingInvalidations.push_back(windowId);
+  }
+  
+  // wakes up the GUI thread if it is waiting for events
+  QCoreApplication::postEvent(inputCapture,new QEvent(QEvent::User));
+}
 
-  QHashIterator<int,QWidget*> it(widgets);
+bool guiWaitForInvalidation(int timeoutMs)
+{
+  if (inputCapture->activity || lateInputPending || takeInvalidations() || takeTileArrivals()) return true;
   
-  while (it.hasNext()) 
+  QElapsedTimer clock;
+  clock.start();
+  
+  int timer = (timeoutMs>=0) ? inputCapture->startTimer(timeoutMs) : 0;
+  
+  bool woken = false;
+  
+  while (!woken)
   {
-    it.next();
-    int id = it.key();
-
-    remlist.push_back(id);
+    app->processEvents(QEventLoop::WaitForMoreEvents);
+    
+    woken = inputCapture->activity || takeInvalidations() || takeTileArrivals();
+    
+    if (timeoutMs>=0 && clock.elapsed()>=timeoutMs) break;
   }
   
-  for(int i=0;i<remlist.size();i++)
+  if (timer!=0) inputCapture->killTimer(timer);
+  
+  return woken;
+}
+
+bool guiWindowInvalidated(int windowId)
+{
+  if (invalidatedWindows.contains(windowId)) return true;
+  
+  int index = nodeTable.find(scopedId(windowId),false);
+  
+  return index!=-1 && inputCapture->activeWindows.contains((QWidget*)nodeTable[index].object);
+}
+
+QVector<quint64> changedIds;
+
+// Ids of the changed widgets in the order of the changes, as scopedId() computed them at declaration.
+const unsigned long long* changedWidgetIds(QWidget* window,int* count)
+{
+  changedIds.clear();
+  
+  for(int i=0;i<changedWidgets.size();i++)
   {
-    deleteWidget(widgets[remlist[i]]);
+    IMWidget* imWidget = changedWidgets[i];
+    
+    if (window!=0 && dynamic_cast<QWidget*>(imWidget)->window()!=window) continue;
+    
+    // recycled since it changed
+    if (imWidget->node==-1) continue;
+    
+    changedIds.push_back(nodeTable[imWidget->node].uid);
   }
   
-  remlist.clear();
+  if (count!=0) *count = changedIds.size();
   
-  QHashIterator<int,QLayout*> lit(layouts);
+  return changedIds.isEmpty() ? 0 : (const unsigned long long*)changedIds.constData();
+}
+
+const unsigned long long* guiChangedWidgets(int* count)
+{
+  return changedWidgetIds(0,count);
+}
+
+const unsigned long long* guiChangedWidgets(int windowId,int* count)
+{
+  int index = nodeTable.find(scopedId(windowId),false);
   
-  while (lit.hasNext()) 
+  if (index==-1)
   {
-    lit.next();
-    int id = lit.key();
+    if (count!=0) *count = 0;
+    return 0;
+  }
+  
+  return changedWidgetIds((QWidget*)nodeTable[index].object,count);
+}
+
+void guiStats(GuiStats* stats)
+{
+  assert(stats!=0);
+  *stats = lastFrameStats;
+}
+
+void guiSetWidgetPoolCapacity(int capacity)
+{
+  assert(capacity>=0);
+  
+  widgetPoolCapacity = capacity;
+  clearWidgetPools(capacity);
+}
+
+void guiSetFrameBudget(int creationMs,int teardownMs)
+{
+  assert(creationMs>=0 && teardownMs>=0);
+  
+  creationBudget = creationMs;
+  teardownBudget = teardownMs;
+}
+
+void guiSetDisplayRate(int hz)
+{
+  assert(hz>=0);
+  
+  displayRate = hz;
+  displayPeriod = (hz>0) ? Q_INT64_C(1000000000)/hz : 0;
+  
+  displayClock.start();
+  nextSync = 0;
+  syncFrame = true;
+}
+
+int guiTimeToSync()
+{
+  if (syncFrame) return 0;
+  
+  qint64 remaining = (nextSync-displayClock.nsecsElapsed())/1000;
+  
+  return (remaining>0) ? (int)remaining : 1;
+}
+
+void guiSetInputPump(InputPump pump)
+{
+  inputPump = pump;
+}
+
+void guiSetInputLatencyHook(InputLatencyHook hook)
+{
+  inputLatencyHook = hook;
+}
 
-    remlist.push_back(id);
+void guiCleanup()
+{
+  clearWidgetPools(0);
+  widgetPools.clear();
+  
+  nodeTable.splice(NodeTable::StaleWidgets,NodeTable::FreshWidgets);
+  nodeTable.splice(NodeTable::StaleLayouts,NodeTable::FreshLayouts);
+  
+  // Bulk teardown: instead of removing the nodes one by one, the top-level widgets are collected and deleted
+  // together with everything below them, then the table is dropped as a whole.
+  QVector<QObject*> roots;
+  
+  for(int index=nodeTable.first(NodeTable::StaleWidgets);index!=NodeTable::StaleWidgets;)
+  {
+    int next = nodeTable[index].next;
+    QWidget* widget = (QWidget*)nodeTable[index].object;
+    
+    //// HACK !!!!
+    if (widget->inherits("GLContextPrivate")) rescueGLWidget(index);
+    else if (widget->parentWidget()==0) roots.push_back(widget);
+    
+    index = next;
   }
   
-  for(int i=0;i<remlist.size();i++)
+  for(int index=nodeTable.first(NodeTable::StaleLayouts);index!=NodeTable::StaleLayouts;index=nodeTable[index].next)
   {
-    deleteLayout(layouts[remlist[i]]);
-  }   
+    if (nodeTable[index].object->parent()==0) roots.push_back(nodeTable[index].object);
+  }
+  
+  nodeTable.clear();
+  
+  for(int i=0;i<roots.size();i++) delete roots[i];
   
-  fresh.clear();
+  deleteDetached(0);
   
   orderStack.clear();
   layoutStack.clear();
   widgetStack.clear();  
+  inputStack.clear();
+  idStack.clear();
+  cacheStack.clear();
+  cacheBlocks.clear();
+  blocksWithInput.clear();
+  blocksWithInputDirty = -1;
+  bindings.clear();
+  boundValues.clear();
+  bindingIndices.clear();
+  bindingNodes.clear();
+  boundItems.clear();
+  changedIds.clear();
+  invalidatedWindows.clear();
+  pendingInvalidations.clear();
+  lateInputWidgets.clear();
+  lateInput = false;
+  lateInputPending = false;
   
-  layoutPosition.clear();  
-  
-  parentLayout.clear();  
-  
-  widgets.clear();
-  layouts.clear();
+  optPropertyIndices.clear();
+  optDefaults.clear();
   
   showlist.clear();
+  touchedWindows.clear();
+  boxFrames.clear();
 
+  tileCacheCleanup();
+  
+  delete inputCapture;
   delete app;
 };
 
@@ -1693,17 +4219,16 @@ GLContext::~GLContext()
 {
   QWidget* widget = glContextPrivate;
 
-  if (widget->property("id").isValid())
+  int index = nodeTable.nodeOf(widget);
+  
+  if (index!=-1)
   {
-      if (parentLayout[widget]!=(QLayout*)-1) parentLayout[widget]->removeWidget(widget);
+    if (nodeTable[index].attached) nodeTable[index].parentLayout->removeWidget(widget);
             
-      parentLayout.remove(widget);
-      if (layoutPosition.contains(widget)) layoutPosition.remove(widget);
-      //if (order.contains(widget)) order.remove(widget);
-      fresh.remove(widget);
-      widgets.remove(widget->property("id").toInt());
+    //if (order.contains(widget)) order.remove(widget);
+    nodeTable.remove(index);
 
-      widget->clearFocus();           
+    widget->clearFocus();           
   }
 
   delete widget;
@@ -1721,19 +4246,17 @@ void GLContext::doneCurrent()
 
 void GLWidgetBegin(int id,GLContext* ctx,const Opts& opts)
 {
-  GLContextPrivate* glWidget = NULL;
-  if (widgets.contains(id))
-  {
-    glWidget = (GLContextPrivate*)widgets[id];
-  }
-  else
+  int node = -1;
+  GLContextPrivate* glWidget = fetchCachedWidget<GLContextPrivate>(id,&node);
+  
+  if (glWidget==0)
   {
     glWidget = ctx->glContextPrivate;
     
-    initializeWidget(id,glWidget,*opts.opts);
+    node = initializeWidget(id,glWidget,*opts.opts);
   }
   
-  finalizeWidget(glWidget,*opts.opts);
+  finalizeWidget(node,*opts.opts);
   
   if (glWidget->isVisible()==false) glWidget->show();
   
@@ -1743,6 +4266,7 @@ void GLWidgetBegin(int id,GLContext* ctx,const Opts& opts)
   orderStack.push(0);
 */  
   widgetStack.push(glWidget);  
+  inputStack.push(&glWidget->input);
 }
 
 void GLWidgetEnd()
@@ -1754,4 +4278,5 @@ void GLWidgetEnd()
   glWidget->doneCurrent(); 
   
   widgetStack.pop();
+  inputStack.pop();
 }
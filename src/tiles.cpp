@@ -0,0 +1,653 @@
+#include <cassert>
+#include <cmath>
+
+#include <QFile>
+#include <QImage>
+#include <QPainter>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QAtomicInt>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QCoreApplication>
+#include <QEvent>
+
+#include "convert.h"
+#include "tiles.h"
+
+enum { TileSize = TiledImageTileSize, StaleRequestPaints = 4 };
+
+struct TiledImage
+{
+  int serial;
+  int width;
+  int height;
+  int levels;         // level n is downscaled by 2^n, the last level fits into one tile
+
+  QFile* file;        // mapped raw file, 0 for callback images
+  unsigned char* mapping;
+  ConvertSource source;
+
+  TileCallback callback;
+  void* user;
+
+  QAtomicInt arrivals;
+  QAtomicInt paintSerial;  // counts the paints, requests not renewed by the last few paints are dropped
+  QAtomicInt closing;
+  QAtomicInt coarseFromChildren; // the callback declined the coarsest level, it is not prefetched
+};
+
+struct CachedTile
+{
+  quint64 key;
+  QImage image;
+  CachedTile* newer;
+  CachedTile* older;
+};
+
+// Tiles of all images, shared by the GUI thread and the tile threads. All members are guarded by mutex.
+struct TileCache
+{
+  QMutex mutex;
+
+  QHash<quint64,CachedTile*> tiles;
+  CachedTile* newest;
+  CachedTile* oldest;
+
+  QHash<quint64,int> pending;  // requested tiles and the paint that requested them last
+
+  qint64 bytes;
+  qint64 budget;
+
+  TileCache()
+  {
+    newest = 0;
+    oldest = 0;
+    bytes = 0;
+    budget = Q_INT64_C(256)*1024*1024;
+  }
+
+  void unlink(CachedTile* tile)
+  {
+    if (tile->newer!=0) tile->newer->older = tile->older; else newest = tile->older;
+    if (tile->older!=0) tile->older->newer = tile->newer; else oldest = tile->newer;
+  }
+
+  void pushNewest(CachedTile* tile)
+  {
+    tile->newer = 0;
+    tile->older = newest;
+
+    if (newest!=0) newest->newer = tile; else oldest = tile;
+    newest = tile;
+  }
+
+  // a null image when the tile is not cached, found tiles become the most recently used
+  QImage find(quint64 key)
+  {
+    QHash<quint64,CachedTile*>::iterator it = tiles.find(key);
+
+    if (it==tiles.end()) return QImage();
+
+    CachedTile* tile = it.value();
+
+    if (tile!=newest)
+    {
+      unlink(tile);
+      pushNewest(tile);
+    }
+
+    return tile->image;
+  }
+
+  void insert(quint64 key,const QImage& image)
+  {
+    if (tiles.contains(key)) return;
+
+    CachedTile* tile = new CachedTile();
+    tile->key = key;
+    tile->image = image;
+
+    pushNewest(tile);
+    tiles.insert(key,tile);
+    bytes += image.bytesPerLine()*image.height();
+
+    evict();
+  }
+
+  void remove(CachedTile* tile)
+  {
+    unlink(tile);
+    tiles.remove(tile->key);
+    bytes -= tile->image.bytesPerLine()*tile->image.height();
+
+    delete tile;
+  }
+
+  // the newest tile stays, even when it alone is over the budget
+  void evict()
+  {
+    while (bytes>budget && oldest!=newest) remove(oldest);
+  }
+
+  void removeImage(int serial)
+  {
+    CachedTile* tile = oldest;
+
+    while (tile!=0)
+    {
+      CachedTile* newer = tile->newer;
+      if ((int)(tile->key>>48)==serial) remove(tile);
+      tile = newer;
+    }
+  }
+
+  void clear()
+  {
+    while (oldest!=0) remove(oldest);
+    pending.clear();
+  }
+};
+
+TileCache tileCache;
+QThreadPool* tilePool = 0;
+QAtomicInt tileArrivals;
+int lastSerial = 0;
+QSet<int> usedSerials;  // serials of the open images, the GUI thread only
+
+inline int levelSize(int size,int level)
+{
+  return (size+(1<<level)-1)>>level;
+}
+
+inline int tileCount(int size,int level)
+{
+  return (levelSize(size,level)+TileSize-1)/TileSize;
+}
+
+inline quint64 tileKey(int serial,int level,int tileX,int tileY)
+{
+  return ((quint64)serial<<48) | ((quint64)level<<40) | ((quint64)tileY<<20) | (quint64)tileX;
+}
+
+inline unsigned int average(unsigned int a,unsigned int b,unsigned int c,unsigned int d)
+{
+  unsigned int rb = ((a&0x00FF00FFu)+(b&0x00FF00FFu)+(c&0x00FF00FFu)+(d&0x00FF00FFu)+0x00020002u)>>2;
+  unsigned int ag = (((a>>8)&0x00FF00FFu)+((b>>8)&0x00FF00FFu)+((c>>8)&0x00FF00FFu)+((d>>8)&0x00FF00FFu)+0x00020002u)>>2;
+
+  return (rb&0x00FF00FFu) | ((ag&0x00FF00FFu)<<8);
+}
+
+inline unsigned int childPixel(const QImage children[2][2],int x,int y)
+{
+  const QImage& child = children[y/TileSize][x/TileSize];
+  return ((const unsigned int*)child.scanLine(y%TileSize))[x%TileSize];
+}
+
+// Box filters the 2x2 tiles of the level below into tile. width and height is the part of the level below
+// they cover, the last row and column repeat where the level below has an odd size.
+void downsample(const QImage children[2][2],int width,int height,QImage& tile)
+{
+  for(int y=0;y<tile.height();y++)
+  {
+    int y0 = qMin(2*y,height-1);
+    int y1 = qMin(2*y+1,height-1);
+
+    unsigned int* dst = (unsigned int*)tile.scanLine(y);
+
+    for(int x=0;x<tile.width();x++)
+    {
+      int x0 = qMin(2*x,width-1);
+      int x1 = qMin(2*x+1,width-1);
+
+      dst[x] = average(childPixel(children,x0,y0),childPixel(children,x1,y0),childPixel(children,x0,y1),childPixel(children,x1,y1));
+    }
+  }
+}
+
+QImage buildTile(TiledImage* image,int level,int tileX,int tileY,bool directOnly = false);
+
+// runs on the tile threads, tiles of the level below that are not cached are built on the spot
+QImage cachedOrBuiltTile(TiledImage* image,int level,int tileX,int tileY)
+{
+  quint64 key = tileKey(image->serial,level,tileX,tileY);
+
+  {
+    QMutexLocker locker(&tileCache.mutex);
+    QImage tile = tileCache.find(key);
+
+    if (!tile.isNull()) return tile;
+  }
+
+  QImage tile = buildTile(image,level,tileX,tileY);
+
+  QMutexLocker locker(&tileCache.mutex);
+  tileCache.insert(key,tile);
+
+  return tile;
+}
+
+bool childrenCached(TiledImage* image,int level,int tileX,int tileY)
+{
+  int countX = tileCount(image->width,level-1);
+  int countY = tileCount(image->height,level-1);
+
+  QMutexLocker locker(&tileCache.mutex);
+
+  for(int i=0;i<2;i++)
+  {
+    for(int j=0;j<2;j++)
+    {
+      if (2*tileX+j>=countX || 2*tileY+i>=countY) continue;
+      if (!tileCache.tiles.contains(tileKey(image->serial,level-1,2*tileX+j,2*tileY+i))) return false;
+    }
+  }
+
+  return true;
+}
+
+void buildFromChildren(TiledImage* image,int level,int tileX,int tileY,QImage& tile)
+{
+  int countX = tileCount(image->width,level-1);
+  int countY = tileCount(image->height,level-1);
+
+  QImage children[2][2];
+
+  for(int i=0;i<2;i++)
+  {
+    for(int j=0;j<2;j++)
+    {
+      if (2*tileX+j<countX && 2*tileY+i<countY) children[i][j] = cachedOrBuiltTile(image,level-1,2*tileX+j,2*tileY+i);
+    }
+  }
+
+  downsample(children,
+             levelSize(image->width,level-1)-2*tileX*TileSize,
+             levelSize(image->height,level-1)-2*tileY*TileSize,
+             tile);
+}
+
+// Without the finer tiles at hand, a level n pixel averages 2x2 samples spread over its 2^n x 2^n footprint
+// in the file, which reads only a small part of the file for the coarse levels.
+void sampleSource(const TiledImage* image,int level,int tileX,int tileY,QImage& tile)
+{
+  int step = 1<<level;
+
+  QVector<int> columns(2*tile.width());
+
+  for(int x=0;x<tile.width();x++)
+  {
+    int origin = (tileX*TileSize+x)*step;
+    columns[2*x] = qMin(origin+step/4,image->width-1);
+    columns[2*x+1] = qMin(origin+(3*step)/4,image->width-1);
+  }
+
+  for(int y=0;y<tile.height();y++)
+  {
+    int origin = (tileY*TileSize+y)*step;
+    int y0 = qMin(origin+step/4,image->height-1);
+    int y1 = qMin(origin+(3*step)/4,image->height-1);
+
+    unsigned int* dst = (unsigned int*)tile.scanLine(y);
+
+    for(int x=0;x<tile.width();x++)
+    {
+      unsigned int samples[4];
+
+      convertToARGB32(image->source,columns[2*x],y0,1,1,(unsigned char*)&samples[0],4);
+      convertToARGB32(image->source,columns[2*x+1],y0,1,1,(unsigned char*)&samples[1],4);
+      convertToARGB32(image->source,columns[2*x],y1,1,1,(unsigned char*)&samples[2],4);
+      convertToARGB32(image->source,columns[2*x+1],y1,1,1,(unsigned char*)&samples[3],4);
+
+      dst[x] = average(samples[0],samples[1],samples[2],samples[3]);
+    }
+  }
+}
+
+// directOnly gives up on the tiles the callback declines instead of building them from the level below,
+// it returns a null image for them
+QImage buildTile(TiledImage* image,int level,int tileX,int tileY,bool directOnly)
+{
+  int width = qMin((int)TileSize,levelSize(image->width,level)-tileX*TileSize);
+  int height = qMin((int)TileSize,levelSize(image->height,level)-tileY*TileSize);
+
+  QImage tile(width,height,QImage::Format_ARGB32);
+
+  if (image->callback!=0)
+  {
+    if (image->callback(image->user,level,tileX,tileY,width,height,tile.bits(),tile.bytesPerLine())) return tile;
+
+    if (directOnly)
+    {
+      image->coarseFromChildren.fetchAndStoreOrdered(1);
+      return QImage();
+    }
+
+    if (level==0) tile.fill(0); else buildFromChildren(image,level,tileX,tileY,tile);
+
+    return tile;
+  }
+
+  if (level==0)
+  {
+    convertToARGB32(image->source,tileX*TileSize,tileY*TileSize,width,height,tile.bits(),tile.bytesPerLine());
+  }
+  else if (childrenCached(image,level,tileX,tileY))
+  {
+    buildFromChildren(image,level,tileX,tileY,tile);
+  }
+  else
+  {
+    sampleSource(image,level,tileX,tileY,tile);
+  }
+
+  return tile;
+}
+
+class TileJob : public QRunnable
+{
+public:
+  TiledImage* image;
+  int level;
+  int tileX;
+  int tileY;
+  bool directOnly;
+
+  TileJob(TiledImage* image,int level,int tileX,int tileY,bool directOnly = false)
+  {
+    this->image = image;
+    this->level = level;
+    this->tileX = tileX;
+    this->tileY = tileY;
+    this->directOnly = directOnly;
+  }
+
+  void run()
+  {
+    quint64 key = tileKey(image->serial,level,tileX,tileY);
+
+    {
+      QMutexLocker locker(&tileCache.mutex);
+
+      // the view has moved on since the tile was requested
+      if ((int)image->closing!=0 || (int)image->paintSerial-tileCache.pending.value(key)>StaleRequestPaints)
+      {
+        tileCache.pending.remove(key);
+        return;
+      }
+    }
+
+    QImage tile = buildTile(image,level,tileX,tileY,directOnly);
+
+    {
+      QMutexLocker locker(&tileCache.mutex);
+
+      tileCache.pending.remove(key);
+
+      // a declined tile still wakes the views, one of them may wait for it at this level
+      if (!tile.isNull()) tileCache.insert(key,tile);
+    }
+
+    image->arrivals.ref();
+    tileArrivals.fetchAndStoreOrdered(1);
+
+    // wakes up the GUI thread if it is waiting for events
+    QCoreApplication::postEvent(QCoreApplication::instance(),new QEvent(QEvent::User));
+  }
+};
+
+TiledImage* newTiledImage(int width,int height)
+{
+  assert(width>0 && height>0);
+
+  TiledImage* image = new TiledImage();
+  // serials are the top 16 bits of the tile keys, 1..65535, those of open images are not reused
+  assert(usedSerials.size()<0xFFFF);
+
+  do lastSerial = lastSerial%0xFFFF+1; while (usedSerials.contains(lastSerial));
+
+  usedSerials.insert(lastSerial);
+
+  image->serial = lastSerial;
+  image->width = width;
+  image->height = height;
+  image->file = 0;
+  image->mapping = 0;
+  image->callback = 0;
+  image->user = 0;
+
+  image->levels = 1;
+  while (image->levels<24 && (tileCount(width,image->levels-1)>1 || tileCount(height,image->levels-1)>1)) image->levels++;
+
+  return image;
+}
+
+TiledImage* tiledImageOpen(const char* fileName,long long offset,int width,int height,int stride,PixmapFormat format,float low,float high)
+{
+  bool planar = (format==PixmapNV12 || format==PixmapYUV420);
+  qint64 size = (qint64)stride*(height+(planar ? (height+1)/2 : 0));
+
+  QFile* file = new QFile(fileName);
+
+  unsigned char* mapping = 0;
+
+  if (file->open(QFile::ReadOnly) && file->size()>=offset+size) mapping = file->map(offset,size);
+
+  if (mapping==0)
+  {
+    delete file;
+    return 0;
+  }
+
+  TiledImage* image = newTiledImage(width,height);
+  image->file = file;
+  image->mapping = mapping;
+  image->source.data = mapping;
+  image->source.stride = stride;
+  image->source.frameHeight = height;
+  image->source.format = format;
+  image->source.low = low;
+  image->source.high = high;
+
+  return image;
+}
+
+TiledImage* tiledImageCreate(int width,int height,TileCallback callback,void* user)
+{
+  assert(callback!=0);
+
+  TiledImage* image = newTiledImage(width,height);
+  image->callback = callback;
+  image->user = user;
+
+  return image;
+}
+
+void tiledImageDestroy(TiledImage* image)
+{
+  if (image==0) return;
+
+  image->closing.fetchAndStoreOrdered(1);
+
+  if (tilePool!=0) tilePool->waitForDone();
+
+  {
+    QMutexLocker locker(&tileCache.mutex);
+    tileCache.removeImage(image->serial);
+  }
+
+  usedSerials.remove(image->serial);
+
+  if (image->file!=0)
+  {
+    image->file->unmap(image->mapping);
+    delete image->file;
+  }
+
+  delete image;
+}
+
+void guiSetTileCacheBudget(int megabytes)
+{
+  assert(megabytes>0);
+
+  QMutexLocker locker(&tileCache.mutex);
+
+  tileCache.budget = (qint64)megabytes*1024*1024;
+  tileCache.evict();
+}
+
+QSize tiledImageSize(const TiledImage* image)
+{
+  return QSize(image->width,image->height);
+}
+
+int tiledImageArrivals(const TiledImage* image)
+{
+  return image->arrivals;
+}
+
+bool takeTileArrivals()
+{
+  return tileArrivals.fetchAndStoreOrdered(0)!=0;
+}
+
+// Caller holds the cache mutex. Renews the request of a pending tile, true when the tile has to be started.
+bool requestTile(quint64 key,int serial)
+{
+  if (tileCache.tiles.contains(key)) return false;
+
+  QHash<quint64,int>::iterator it = tileCache.pending.find(key);
+
+  if (it!=tileCache.pending.end())
+  {
+    it.value() = serial;
+    return false;
+  }
+
+  tileCache.pending.insert(key,serial);
+
+  return true;
+}
+
+void paintTiledImage(TiledImage* image,QPainter& painter,const QRectF& view,float zoom,const QRect& exposed,bool smooth)
+{
+  int serial = image->paintSerial.fetchAndAddOrdered(1)+1;
+
+  // the finest level that is not shown smaller than half its size
+  int level = 0;
+  while (level+1<image->levels && zoom*(1<<(level+1))<=1.0f) level++;
+
+  float scale = zoom*(1<<level);
+  float span = TileSize*scale;
+
+  int countX = tileCount(image->width,level);
+  int countY = tileCount(image->height,level);
+  int levelWidth = levelSize(image->width,level);
+  int levelHeight = levelSize(image->height,level);
+
+  int left = qMax(0,(int)floor((exposed.x()-view.x())/span));
+  int top = qMax(0,(int)floor((exposed.y()-view.y())/span));
+  int right = qMin(countX-1,(int)floor((exposed.x()+exposed.width()-view.x())/span));
+  int bottom = qMin(countY-1,(int)floor((exposed.y()+exposed.height()-view.y())/span));
+
+  if (left>right || top>bottom) return;
+
+  QVector<QImage> images;
+  QVector<QRectF> targets;
+  QVector<QRectF> sources;
+
+  QVector<TileJob*> visibleJobs;
+  QVector<TileJob*> prefetchJobs;
+
+  {
+    QMutexLocker locker(&tileCache.mutex);
+
+    for(int tileY=top;tileY<=bottom;tileY++)
+    {
+      for(int tileX=left;tileX<=right;tileX++)
+      {
+        int width = qMin((int)TileSize,levelWidth-tileX*TileSize);
+        int height = qMin((int)TileSize,levelHeight-tileY*TileSize);
+
+        QRectF target(view.x()+tileX*span,view.y()+tileY*span,width*scale,height*scale);
+
+        quint64 key = tileKey(image->serial,level,tileX,tileY);
+        QImage tile = tileCache.find(key);
+
+        if (!tile.isNull())
+        {
+          images.push_back(tile);
+          targets.push_back(target);
+          sources.push_back(QRectF(tile.rect()));
+          continue;
+        }
+
+        if (requestTile(key,serial)) visibleJobs.push_back(new TileJob(image,level,tileX,tileY));
+
+        // a coarser level stands in until the tile arrives
+        for(int coarser=level+1;coarser<image->levels;coarser++)
+        {
+          int shift = coarser-level;
+          QImage parent = tileCache.find(tileKey(image->serial,coarser,tileX>>shift,tileY>>shift));
+
+          if (parent.isNull()) continue;
+
+          float factor = 1.0f/(1<<shift);
+
+          images.push_back(parent);
+          targets.push_back(target);
+          sources.push_back(QRectF(tileX*TileSize*factor-(tileX>>shift)*TileSize,tileY*TileSize*factor-(tileY>>shift)*TileSize,
+                                   width*factor,height*factor));
+          break;
+        }
+      }
+    }
+
+    // the ring of tiles around the visible ones, and the single tile of the coarsest level that can stand
+    // in for any other when it can be had without building the whole pyramid below it
+    for(int tileY=top-1;tileY<=bottom+1;tileY++)
+    {
+      for(int tileX=left-1;tileX<=right+1;tileX++)
+      {
+        if (tileX<0 || tileY<0 || tileX>=countX || tileY>=countY) continue;
+        if (tileX>=left && tileX<=right && tileY>=top && tileY<=bottom) continue;
+
+        if (requestTile(tileKey(image->serial,level,tileX,tileY),serial)) prefetchJobs.push_back(new TileJob(image,level,tileX,tileY));
+      }
+    }
+
+    bool coarsestDirect = (image->callback==0 || (int)image->coarseFromChildren==0);
+
+    if (coarsestDirect && requestTile(tileKey(image->serial,image->levels-1,0,0),serial))
+    {
+      prefetchJobs.push_back(new TileJob(image,image->levels-1,0,0,image->callback!=0));
+    }
+  }
+
+  if (tilePool==0) tilePool = new QThreadPool();
+
+  for(int i=0;i<visibleJobs.size();i++) tilePool->start(visibleJobs[i],1);
+  for(int i=0;i<prefetchJobs.size();i++) tilePool->start(prefetchJobs[i],0);
+
+  painter.setRenderHint(QPainter::SmoothPixmapTransform,smooth);
+
+  for(int i=0;i<images.size();i++) painter.drawImage(targets[i],images[i],sources[i]);
+}
+
+void tileCacheCleanup()
+{
+  if (tilePool!=0)
+  {
+    tilePool->waitForDone();
+
+    delete tilePool;
+    tilePool = 0;
+  }
+
+  QMutexLocker locker(&tileCache.mutex);
+  tileCache.clear();
+}
@@ -0,0 +1,28 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <QSize>
+#include <QRect>
+#include <QRectF>
+
+#include <gui.h>
+
+class QPainter;
+
+QSize tiledImageSize(const TiledImage* image);
+
+// Number of tiles finished for the image so far, views repaint when it changes
+int tiledImageArrivals(const TiledImage* image);
+
+// Set by the tile threads, taken by guiUpdate() so that lazy loops redraw when tiles arrive
+bool takeTileArrivals();
+
+// Paints the tiles of image that intersect exposed, with the whole image at view scaled by zoom. Tiles that
+// are not cached yet are requested from the tile threads together with their neighbours, meanwhile a coarser
+// cached level stands in for them.
+void paintTiledImage(TiledImage* image,QPainter& painter,const QRectF& view,float zoom,const QRect& exposed,bool smooth);
+
+// Waits for the tile threads and empties the cache
+void tileCacheCleanup();
+
+#endif
@@ -18,65 +18,474 @@
 #include <QHBoxLayout>
 #include <QScrollArea>
 #include <QSet>
+#include <QVector>
+#include <QPointer>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QBitArray>
+#include <QImage>
+#include <QPainter>
+#include <QPaintEvent>
 
 #include <cstdio>
+#include <cmath>
+
+#include <gui.h>
+
+#include "tiles.h"
+
+class IMWidget;
+
+// widgets whose per-frame state has to be reset by the next guiUpdate()
+extern QVector<IMWidget*> dirtyWidgets;
+
+// widgets whose value was changed by the user since the last guiUpdate()
+extern QVector<IMWidget*> changedWidgets;
+
+// time base of IMWidget::changeTime
+extern QElapsedTimer latencyClock;
+
+// Common interface of the immediate-mode widgets. Event handlers that set some per-frame
+// state call markDirty(), guiUpdate() then calls updateState() only on the dirty widgets.
+// Handlers of value changes call markChanged() instead, which also lists the widget for guiChangedWidgets().
+class IMWidget
+{
+public:
+  bool dirty;
+  bool changed;
+  qint64 changeTime; // ns, when the first change not yet returned by the widget function arrived, -1 if none
+  int node;          // index in the node table, -1 until the widget is declared
+
+  IMWidget()
+  {
+    dirty = false;
+    changed = false;
+    changeTime = -1;
+    node = -1;
+  }
+
+  virtual ~IMWidget()
+  {
+    if (dirty) dirtyWidgets.remove(dirtyWidgets.indexOf(this));
+    if (changed) changedWidgets.remove(changedWidgets.indexOf(this));
+  }
+
+  void markDirty()
+  {
+    if (dirty) return;
+    dirty = true;
+    dirtyWidgets.push_back(this);
+  }
+
+  void markChanged()
+  {
+    markDirty();
+    
+    if (changeTime==-1) changeTime = latencyClock.nsecsElapsed();
+    
+    if (changed) return;
+    changed = true;
+    changedWidgets.push_back(this);
+  }
+
+  virtual void updateState() = 0;
+};
   
-class IMEventFilter : public QObject
+// Keyboard and pointer input capture, installed on the application so that it sees input before
+// the focus widget consumes it. Anything that is not an input event leaves through the first switch.
+class IMInputCapture : public QObject
 {
   Q_OBJECT
 public:
-  QSet<Qt::Key> keyDownSet;
-  QSet<Qt::Key> keyPressedSet;
-  QSet<Qt::Key> keyUpSet;
+  struct Event
+  {
+    int type;          // InputEventType
+    int key;           // Qt::Key for key events, Qt::MouseButton for button events
+    int text;          // unicode character produced by a key press
+    QPoint globalPos;
+    int buttons;
+    int delta;
+    int time;
+  };
 
-  bool eventFilter(QObject *object, QEvent *event)
+  // Qt::Key values are either unicode characters or 0x01000000 | code,
+  // both ranges map into one bit array
+  enum { KeyStateSize = 0x20000 };
+
+  enum { MaxEvents = 65536 };
+
+  QBitArray keyDownBits;     // went down this frame
+  QBitArray keyPressedBits;  // held since an earlier frame
+  QBitArray keyUpBits;       // released this frame
+  QBitArray keyHeldBits;     // physically held right now
+
+  QVector<int> downKeys;     // indices set in keyDownBits, so that the frame reset is O(events)
+  QVector<int> upKeys;
+  QVector<int> heldKeys;
+
+  // Last known pointer position, taken from mouse events so that querying it never
+  // needs a window system round-trip (which QCursor::pos() is on X11).
+  QPoint mouseGlobalPos;
+  bool mousePosValid;
+
+  // input received since the last updateState(), in arrival order
+  QVector<Event> events;
+
+  // Once the frame queried the input, what a pump in the middle of the frame dispatches is held back
+  // until the next updateState(), so that it neither changes under the frame nor gets lost.
+  bool queried;
+  bool deferring;
+  QVector<Event> deferred;
+
+  QElapsedTimer clock;
+
+  // Input events propagate from the receiver to its parents and pass through here once per widget. Qt hands
+  // the same key event up the chain, but sends every parent its own copy of a mouse or wheel event, which
+  // carries the position, buttons and delta of the original.
+  QObject* lastReceiver;
+  QEvent* lastEvent;
+  int lastType;
+  int lastKey;
+  QPoint lastGlobalPos;
+  int lastButtons;
+  int lastDelta;
+
+  // any input, window resize or close, or application timer since the last updateState()
+  bool activity;
+  QVector<QWidget*> activeWindows;
+
+  // While holding, repaint and relayout requests are kept here instead of being delivered, releaseHeld()
+  // posts them again. Input-only ticks of the display-rate mode paint only at the display rate this way.
+  struct HeldRequest
+  {
+    QPointer<QObject> object;
+    int type;
+  };
+
+  bool holding;
+  QVector<HeldRequest> held;
+
+  IMInputCapture() : keyDownBits(KeyStateSize),
+                     keyPressedBits(KeyStateSize),
+                     keyUpBits(KeyStateSize),
+                     keyHeldBits(KeyStateSize)
   {
-    if (event->type() == QEvent::KeyPress)
+    mousePosValid = false;
+    queried = false;
+    deferring = false;
+    holding = false;
+    lastReceiver = 0;
+    lastEvent = 0;
+    lastType = QEvent::None;
+    lastKey = 0;
+    lastButtons = 0;
+    lastDelta = 0;
+    activity = false;
+    clock.start();
+  }
+
+  static int keyIndex(int key)
+  {
+    if (key>=0 && key<0x10000) return key;
+    if ((key & 0xFFFF0000)==0x01000000) return 0x10000 | (key & 0xFFFF);
+    return -1;
+  }
+
+  bool isPropagation(QObject* object,QEvent* event)
+  {
+    int key = 0;
+    QPoint globalPos;
+    int buttons = 0;
+    int delta = 0;
+
+    switch(event->type())
     {
-      if (((QKeyEvent*)event)->isAutoRepeat()==false)
-      {
-        keyDownSet.insert((Qt::Key)((QKeyEvent*)event)->key());  
-      }        
+      case QEvent::KeyPress:
+      case QEvent::KeyRelease:
+        key = ((QKeyEvent*)event)->key();
+        break;
+
+      case QEvent::Wheel:
+        globalPos = ((QWheelEvent*)event)->globalPos();
+        buttons = ((QWheelEvent*)event)->buttons();
+        delta = ((QWheelEvent*)event)->delta();
+        break;
+
+      default:
+        globalPos = ((QMouseEvent*)event)->globalPos();
+        buttons = ((QMouseEvent*)event)->button() | ((QMouseEvent*)event)->buttons();
+        break;
+    }
+
+    bool propagated = (event->type()==lastType &&
+                       lastReceiver!=0 &&
+                       lastReceiver->isWidgetType() &&
+                       ((QWidget*)lastReceiver)->parentWidget()==object);
+
+    // a key event is the same object, stack allocated events may reuse its address so the key is compared too
+    if (event->type()==QEvent::KeyPress || event->type()==QEvent::KeyRelease)
+    {
+      propagated = propagated && event==lastEvent && key==lastKey;
+    }
+    else
+    {
+      propagated = propagated && (event==lastEvent || (globalPos==lastGlobalPos && buttons==lastButtons && delta==lastDelta));
+    }
+
+    lastReceiver = object;
+    lastEvent = event;
+    lastType = event->type();
+    lastKey = key;
+    lastGlobalPos = globalPos;
+    lastButtons = buttons;
+    lastDelta = delta;
+
+    return propagated;
+  }
+
+  void applyEvent(const Event& event)
+  {
+    int i = (event.type==InputKeyDown || event.type==InputKeyUp) ? keyIndex(event.key) : -1;
+
+    if (event.type==InputKeyDown && i!=-1 && !keyHeldBits.testBit(i))
+    {
+      keyHeldBits.setBit(i);
+      heldKeys.push_back(i);
+      keyDownBits.setBit(i);
+      downKeys.push_back(i);
     }
 
-    if (event->type() == QEvent::KeyRelease)
+    if (event.type==InputKeyUp && i!=-1 && keyHeldBits.testBit(i))
     {
-      if (((QKeyEvent*)event)->isAutoRepeat()==false)
+      keyHeldBits.clearBit(i);
+      heldKeys.remove(heldKeys.indexOf(i));
+      keyPressedBits.clearBit(i);
+      keyUpBits.setBit(i);
+      upKeys.push_back(i);
+    }
+
+    events.push_back(event);
+  }
+
+  void pushEvent(int type,int key,int text,int buttons,int delta)
+  {
+    if (events.size()+deferred.size()>=MaxEvents && type==InputMouseMove) return;
+
+    Event event;
+    event.type = type;
+    event.key = key;
+    event.text = text;
+    event.globalPos = mouseGlobalPos;
+    event.buttons = buttons;
+    event.delta = delta;
+    event.time = (int)clock.elapsed();
+
+    if (deferring) deferred.push_back(event); else applyEvent(event);
+  }
+
+  void keyPressEvent(QKeyEvent* event)
+  {
+    int text = event->text().isEmpty() ? 0 : event->text().at(0).unicode();
+
+    pushEvent(event->isAutoRepeat() ? InputKeyRepeat : InputKeyDown,event->key(),text,0,0);
+  }
+
+  // the window system does not deliver releases of keys that were let go while the application was inactive
+  void releaseAllKeys()
+  {
+    QVector<int> keys = heldKeys;
+
+    // including the keys of the held back input
+    for(int j=0;j<deferred.size();j++)
+    {
+      int i = (deferred[j].type==InputKeyDown || deferred[j].type==InputKeyUp) ? keyIndex(deferred[j].key) : -1;
+
+      if (i==-1) continue;
+
+      if (deferred[j].type==InputKeyDown && !keys.contains(i)) keys.push_back(i);
+      if (deferred[j].type==InputKeyUp && keys.contains(i)) keys.remove(keys.indexOf(i));
+    }
+
+    for(int j=0;j<keys.size();j++)
+    {
+      pushEvent(InputKeyUp,(keys[j] & 0x10000) ? (0x01000000 | (keys[j] & 0xFFFF)) : keys[j],0,0,0);
+    }
+  }
+
+  void noteActivity(QObject* object)
+  {
+    activity = true;
+
+    if (!object->isWidgetType()) return;
+
+    QWidget* window = ((QWidget*)object)->window();
+
+    if (!activeWindows.contains(window)) activeWindows.push_back(window);
+  }
+
+  void holdRequest(QObject* object,int type)
+  {
+    for(int i=0;i<held.size();i++)
+    {
+      if (held[i].object==object && held[i].type==type) return;
+    }
+
+    HeldRequest request;
+    request.object = object;
+    request.type = type;
+    held.push_back(request);
+  }
+
+  void releaseHeld()
+  {
+    for(int i=0;i<held.size();i++)
+    {
+      if (!held[i].object.isNull()) QCoreApplication::postEvent(held[i].object,new QEvent((QEvent::Type)held[i].type));
+    }
+
+    held.clear();
+  }
+
+  bool eventFilter(QObject* object,QEvent* event)
+  {
+    switch(event->type())
+    {
+      case QEvent::KeyPress:
+      case QEvent::KeyRelease:
+      case QEvent::MouseMove:
+      case QEvent::MouseButtonPress:
+      case QEvent::MouseButtonDblClick:
+      case QEvent::MouseButtonRelease:
+      case QEvent::Wheel:
+        break;
+
+      case QEvent::ApplicationDeactivate:
+        releaseAllKeys();
+        return false;
+
+      case QEvent::Resize:
+      case QEvent::Close:
+        if (object->isWidgetType() && ((QWidget*)object)->isWindow()) noteActivity(object);
+        return false;
+
+      // timers of the widgets themselves (cursor blinking, animations) are not application activity,
+      // neither are the wake-ups of guiWaitForInvalidation()
+      case QEvent::Timer:
+        if (!object->isWidgetType() && object!=this) activity = true;
+        return false;
+
+      case QEvent::UpdateRequest:
+      case QEvent::LayoutRequest:
+        if (!holding) return false;
+        holdRequest(object,event->type());
+        return true;
+
+      default:
+        return false;
+    }
+
+    if (isPropagation(object,event)) return false;
+
+    noteActivity(object);
+
+    switch(event->type())
+    {
+      case QEvent::KeyPress:
+        keyPressEvent((QKeyEvent*)event);
+        break;
+
+      case QEvent::KeyRelease:
+        if (((QKeyEvent*)event)->isAutoRepeat()==false) pushEvent(InputKeyUp,((QKeyEvent*)event)->key(),0,0,0);
+        break;
+
+      case QEvent::MouseMove:
+      case QEvent::MouseButtonPress:
+      case QEvent::MouseButtonDblClick:
+      case QEvent::MouseButtonRelease:
       {
-        keyPressedSet.remove((Qt::Key)((QKeyEvent*)event)->key());
-        keyUpSet.insert((Qt::Key)((QKeyEvent*)event)->key());
+        QMouseEvent* mouseEvent = (QMouseEvent*)event;
+
+        mouseGlobalPos = mouseEvent->globalPos();
+        mousePosValid = true;
+
+        if (event->type()==QEvent::MouseMove)
+        {
+          pushEvent(InputMouseMove,0,0,mouseEvent->buttons(),0);
+        }
+        else
+        {
+          pushEvent(event->type()==QEvent::MouseButtonRelease ? InputMouseUp : InputMouseDown,
+                    mouseEvent->button(),0,mouseEvent->buttons(),0);
+        }
+        break;
       }
+
+      case QEvent::Wheel:
+      {
+        QWheelEvent* wheelEvent = (QWheelEvent*)event;
+
+        mouseGlobalPos = wheelEvent->globalPos();
+        mousePosValid = true;
+
+        pushEvent(InputMouseWheel,0,0,0,wheelEvent->delta());
+        break;
+      }
+
+      default:
+        break;
     }
 
     return false;
   }
 
   void updateState()
-  {        
-    foreach(Qt::Key key,keyDownSet) keyPressedSet.insert(key);
-    
-    keyDownSet.clear();
-    keyUpSet.clear();
+  {
+    // keys that were pressed and released within one frame are not promoted to pressed
+    for(int j=0;j<downKeys.size();j++)
+    {
+      keyDownBits.clearBit(downKeys[j]);
+      if (keyHeldBits.testBit(downKeys[j])) keyPressedBits.setBit(downKeys[j]);
+    }
+
+    for(int j=0;j<upKeys.size();j++) keyUpBits.clearBit(upKeys[j]);
+
+    downKeys.clear();
+    upKeys.clear();
+
+    events.clear();
+
+    activity = false;
+    activeWindows.clear();
+
+    queried = false;
+
+    QVector<Event> late = deferred;
+    deferred.clear();
+
+    for(int j=0;j<late.size();j++) applyEvent(late[j]);
   }
 
-  bool keyDown(Qt::Key key)
+  bool keyDown(int key) const
   {
-    return keyDownSet.contains(key);
+    int i = keyIndex(key);
+    return i!=-1 && keyDownBits.testBit(i);
   }
-  
-  bool keyPressed(Qt::Key key)
+
+  bool keyPressed(int key) const
   {
-    return keyPressedSet.contains(key);
+    int i = keyIndex(key);
+    return i!=-1 && keyPressedBits.testBit(i);
   }
 
-  bool keyUp(Qt::Key key)
+  bool keyUp(int key) const
   {
-    return keyUpSet.contains(key);
+    int i = keyIndex(key);
+    return i!=-1 && keyUpBits.testBit(i);
   }
 };
 
 
-class IMWindow : public QWidget
+class IMWindow : public QWidget, public IMWidget
 {
   Q_OBJECT
 public:
@@ -90,17 +499,17 @@ public:
   void closeEvent(QCloseEvent* event)
   {
     closeRequest = true;
+    markDirty();
     event->ignore();
   };
 
-public slots:    
   void updateState()
   {
     closeRequest = false;
   }
 };
 
-class IMButton : public QPushButton
+class IMButton : public QPushButton, public IMWidget
 {
   Q_OBJECT
 public:
@@ -114,19 +523,20 @@ public:
                      this,SLOT(buttonClicked()));
   }
 
-public slots:  
   void updateState()
   {
     buttonWasClicked = false;
   }
 
+public slots:
   void buttonClicked()
   {
-    buttonWasClicked = true;  
+    buttonWasClicked = true;
+    markChanged();
   }
 };
 
-class IMToggleButton : public QPushButton
+class IMToggleButton : public QPushButton, public IMWidget
 {
   Q_OBJECT
 public:
@@ -146,19 +556,20 @@ public:
     return hasFocus();
   }
     
-public slots:  
   void updateState()
   {
     buttonWasToggled = false;
   }
 
+public slots:
   void buttonToggled(bool checked)
   {
-    buttonWasToggled = true;  
+    buttonWasToggled = true;
+    markChanged();
   }  
 };
 
-class IMRadioButton : public QRadioButton
+class IMRadioButton : public QRadioButton, public IMWidget
 {
   Q_OBJECT
 public:
@@ -179,19 +590,20 @@ public:
     return false;//hasFocus();
   }
   
-public slots:  
   void updateState()
   {
     radioButtonStateHasChanged = false;
   }
 
+public slots:
   void radioButtonToggled(bool checked)
   {
-    radioButtonStateHasChanged = true;  
+    radioButtonStateHasChanged = true;
+    markChanged();
   }    
 };
 
-class IMCheckBox : public QCheckBox
+class IMCheckBox : public QCheckBox, public IMWidget
 {
   Q_OBJECT
 public:
@@ -210,19 +622,20 @@ public:
     return hasFocus();
   }
     
-public slots:  
   void updateState()
   {
     checkBoxStateHasChanged = false;
   }
 
+public slots:
   void checkBoxToggled(bool checked)
   {
-    checkBoxStateHasChanged = true;  
+    checkBoxStateHasChanged = true;
+    markChanged();
   }  
 };
 
-class IMComboBox : public QComboBox
+class IMComboBox : public QComboBox, public IMWidget
 {
   Q_OBJECT
 public:
@@ -237,19 +650,20 @@ public:
                        
   }
 
-public slots:  
   void updateState()
   {
     comboBoxStateHasChanged = false;
   }
 
+public slots:
   void comboBoxChanged(int index)
   {
-    comboBoxStateHasChanged = true;  
+    comboBoxStateHasChanged = true;
+    markChanged();
   }  
 };
 
-class IMSlider : public QSlider
+class IMSlider : public QSlider, public IMWidget
 {
   Q_OBJECT
 public:
@@ -261,10 +675,9 @@ public:
     mouseOver = false;
     /*
     sliderValueHasChanged = false;
-    
+    */
     QObject::connect(this,SIGNAL(valueChanged(int)),
                      this,SLOT(sliderValueChanged(int)));
-    */                     
   }
   
   void enterEvent(QEvent* event)
@@ -284,20 +697,20 @@ public:
     return (mouseOver || hasFocus());
   }
     
-public slots:  
   void updateState()
   {
   //  sliderValueHasChanged = false;
   }
-/*
+
+public slots:
+  // the library sets the value only while the slider is not hot
   void sliderValueChanged(int value)
   {
-    sliderValueHasChanged = true;  
+    if (isHot()) markChanged();
   }  
-*/  
 };
 
-class IMScrollBar : public QScrollBar
+class IMScrollBar : public QScrollBar, public IMWidget
 {
   Q_OBJECT
 public:
@@ -309,10 +722,9 @@ public:
     mouseOver = false;
     /*
     sliderValueHasChanged = false;
-
+    */
     QObject::connect(this,SIGNAL(valueChanged(int)),
                      this,SLOT(sliderValueChanged(int)));
-    */
   }
 
   void enterEvent(QEvent* event)
@@ -332,21 +744,20 @@ public:
     return mouseOver;// || hasFocus());
   }
     
-public slots:  
   void updateState()
   {
     // sliderValueHasChanged = false;
   }
-  
-  /*
+
+public slots:
+  // the library sets the value only while the scrollbar is not hot
   void sliderValueChanged(int value)
   {
-    sliderValueHasChanged = true;  
+    if (isHot()) markChanged();
   }
-  */
 };
 
-class IMSpinBox : public QSpinBox
+class IMSpinBox : public QSpinBox, public IMWidget
 {
   Q_OBJECT
 public:
@@ -379,20 +790,21 @@ public:
     return (mouseOver || hasFocus());
   }
     
-public slots:  
   void updateState()
   {
     spinBoxValueHasChanged = false;
   }
 
+public slots:
   void spinBoxValueChanged(int value)
   {
-    spinBoxValueHasChanged = true;  
+    spinBoxValueHasChanged = true;
+    markChanged();
   }  
 };
 
 
-class IMDoubleSpinBox : public QDoubleSpinBox
+class IMDoubleSpinBox : public QDoubleSpinBox, public IMWidget
 {
   Q_OBJECT
 public:
@@ -425,19 +837,20 @@ public:
     return (mouseOver || hasFocus());
   }
     
-public slots:  
   void updateState()
   {
     spinBoxValueHasChanged = false;
   }
 
+public slots:
   void spinBoxValueChanged(double value)
   {
-    spinBoxValueHasChanged = true;  
+    spinBoxValueHasChanged = true;
+    markChanged();
   }  
 };
 
-class IMLineEdit : public QLineEdit
+class IMLineEdit : public QLineEdit, public IMWidget
 {
   Q_OBJECT
 public:
@@ -456,100 +869,83 @@ public:
     return hasFocus();
   }
     
-public slots:  
   void updateState()
   {
     lineEditValueHasChanged = false;
   }
 
+public slots:
   void lineEditValueChanged(const QString& value)
   {
-    lineEditValueHasChanged = true;  
+    lineEditValueHasChanged = true;
+    markChanged();
   }  
 };
 
-class IMPixmap : public QLabel
+// Mouse button, wheel and resize state of the widgets that expose raw input (Pixmap, Frame, GLWidget).
+class IMInputState
 {
-  Q_OBJECT
-public:    
-  bool widgetWasResized;
-  
-  int button2id[5];
-
+public:
   enum ButtonState
   {
     Released,Down,Pressed,Up
   };
-  
+
   ButtonState mouseButtonStates[3];
-  int wheelDelta;  
-    
-  IMPixmap()
-  {  
-    widgetWasResized = false;
-    
-    button2id[Qt::LeftButton] = 0;
-    button2id[Qt::RightButton] = 1;
-    button2id[Qt::MidButton] = 2;
-    
+  int wheelDelta;
+  bool widgetWasResized;
+
+  IMInputState()
+  {
     for(int i=0;i<3;i++) mouseButtonStates[i] = Released;
-        
+
     wheelDelta = 0;
-    
-    setMouseTracking(true);     
+    widgetWasResized = false;
   }
-  
-  void resizeEvent(QResizeEvent* event)
-  {
-    widgetWasResized = true;
-  }  
 
-  void mousePressEvent(QMouseEvent* event) 
+  static int buttonIndex(int button)
   {
-    mouseButtonStates[button2id[event->button()]] = Down;
-    setFocus(Qt::MouseFocusReason);
+    switch(button)
+    {
+      case Qt::LeftButton:  return 0;
+      case Qt::RightButton: return 1;
+      case Qt::MidButton:   return 2;
+    }
+    return -1;
   }
 
-  void mouseReleaseEvent(QMouseEvent* event) 
+  ButtonState buttonState(int button) const
   {
-    mouseButtonStates[button2id[event->button()]] = Up;
-  }
-    
-  void wheelEvent(QWheelEvent* event)
-  {
-    wheelDelta = event->delta();
-  }
-  
-public slots:
-  bool widgetResized()
-  {
-    return widgetWasResized;
+    int i = buttonIndex(button);
+    return (i!=-1) ? mouseButtonStates[i] : Released;
   }
 
-  bool mouseDown(int button)
+  void resizeEvent(QResizeEvent* event)
   {
-    return mouseButtonStates[button2id[button]]==Down;
+    widgetWasResized = true;
   }
 
-  bool mousePressed(int button)
+  void mousePressEvent(QMouseEvent* event)
   {
-    return mouseButtonStates[button2id[button]]==Pressed;
+    int i = buttonIndex(event->button());
+    if (i!=-1) mouseButtonStates[i] = Down;
   }
 
-  bool mouseUp(int button)
+  void mouseReleaseEvent(QMouseEvent* event)
   {
-    return mouseButtonStates[button2id[button]]==Up;
+    int i = buttonIndex(event->button());
+    if (i!=-1) mouseButtonStates[i] = Up;
   }
-  
-  int mouseWheelDelta()
+
+  void wheelEvent(QWheelEvent* event)
   {
-    return wheelDelta;
+    wheelDelta += event->delta();
   }
-  
+
   void updateState()
   {
     widgetWasResized = false;
-        
+
     for(int i=0;i<3;i++)
     {
       if (mouseButtonStates[i] == Down) mouseButtonStates[i] = Pressed;
@@ -557,222 +953,409 @@ public slots:
     }
 
     wheelDelta = 0;
-  }   
+  }
 };
 
-class GLContextPrivate : public QWidget
+// Raster view that paints a persistent, library-owned image the application writes into directly.
+// The image is zoomed and panned at paint time, only the exposed part of the view is painted and
+// only the rectangles reported as dirty are repainted.
+class IMPixmap : public QFrame, public IMWidget
 {
   Q_OBJECT
+  Q_PROPERTY(Qt::Alignment alignment READ alignment WRITE setAlignment)
 public:
-  QGLWidget* glWidget;
-  
-  bool widgetWasResized;
-  
-  int button2id[5];
+  IMInputState input;
 
-  enum ButtonState
+  QImage buffer;     // owned, the blits and pixmapLock() write into it
+  QImage feedImage;  // feed frame shown instead of the buffer, wraps memory of the feed
+
+  Qt::Alignment align;
+  float zoom;
+  float panX;     // scroll offset in image pixels
+  float panY;
+  bool smooth;    // bilinear, nearest otherwise
+
+  IMPixmap()
   {
-    Released,Down,Pressed,Up
-  };
-    
-  ButtonState mouseButtonStates[3];  
-  int wheelDelta;  
-      
-  GLContextPrivate()
+    setMouseTracking(true);
+
+    align = Qt::AlignLeft | Qt::AlignVCenter;
+    zoom = 1.0f;
+    panX = 0.0f;
+    panY = 0.0f;
+    smooth = true;
+  }
+
+  Qt::Alignment alignment() const
   {
-    QHBoxLayout* layout = new QHBoxLayout(this);    
-    glWidget = new QGLWidget(QGLFormat::defaultFormat());
-//    layout->setSizeConstraint(QLayout::SetMaximumSize);
-    //glWidget->setSizePolicy(QSizePolicy::Ignored,QSizePolicy::Ignored);
+    return align;
+  }
 
-    layout->setContentsMargins(0,0,0,0);
-    layout->addWidget(glWidget);
-  
-    widgetWasResized = false;
-      
-    button2id[Qt::LeftButton] = 0;
-    button2id[Qt::RightButton] = 1;
-    button2id[Qt::MidButton] = 2;
-    
-    for(int i=0;i<3;i++) mouseButtonStates[i] = Released;
-    
-    wheelDelta = 0;
-    
-    glWidget->setMouseTracking(true);
-    setMouseTracking(true);    
-    //setSizePolicy(QSizePolicy::Ignored,QSizePolicy::Ignored);
+  void setAlignment(Qt::Alignment alignment)
+  {
+    if (align==alignment) return;
+
+    align = alignment;
+    update();
   }
-  
-  ~GLContextPrivate()
+
+  void setView(float newZoom,float newPanX,float newPanY,bool newSmooth)
   {
-    //delete glWidget;
+    if (zoom==newZoom && panX==newPanX && panY==newPanY && smooth==newSmooth) return;
+
+    bool resized = (zoom!=newZoom);
+
+    zoom = newZoom;
+    panX = newPanX;
+    panY = newPanY;
+    smooth = newSmooth;
+
+    if (resized) updateGeometry();
+    update();
   }
-  
-  void makeCurrent()
+
+  const QImage& image() const
   {
-    glWidget->makeCurrent();
+    return feedImage.isNull() ? buffer : feedImage;
   }
 
-  void doneCurrent()
+  // Stops showing a feed frame, the buffer gets a copy of it so that it is shown until it is overwritten
+  void showBuffer()
   {
-    glWidget->doneCurrent();
+    if (feedImage.isNull()) return;
+
+    buffer = feedImage.copy().convertToFormat(QImage::Format_ARGB32);
+    feedImage = QImage();
   }
 
-  void swapBuffers()
+  // reallocates only when the size changes, the contents are undefined afterwards
+  void resizeBuffer(int width,int height)
   {
-    glWidget->swapBuffers();
-  }  
+    showBuffer();
 
-  void resizeEvent(QResizeEvent* event)
+    if (buffer.width()==width && buffer.height()==height) return;
+
+    buffer = QImage(width,height,QImage::Format_ARGB32);
+
+    updateGeometry();
+    update();
+  }
+
+  virtual QSize imageSize() const
   {
-    widgetWasResized = true;
-  }  
+    return image().size();
+  }
 
-  void mousePressEvent(QMouseEvent* event) 
+  // where the whole zoomed image lies in widget coordinates
+  QRectF viewRect() const
   {
-    mouseButtonStates[button2id[event->button()]] = Down;
-    setFocus(Qt::MouseFocusReason);
+    QRect contents = contentsRect();
+    QSize size = imageSize();
+
+    float width = size.width()*zoom;
+    float height = size.height()*zoom;
+
+    float x = contents.x();
+    float y = contents.y();
+
+    if (align & Qt::AlignRight)        x += contents.width()-width;
+    else if (align & Qt::AlignHCenter) x += (contents.width()-width)/2.0f;
+
+    if (align & Qt::AlignBottom)       y += contents.height()-height;
+    else if (align & Qt::AlignVCenter) y += (contents.height()-height)/2.0f;
+
+    return QRectF(x-panX*zoom,y-panY*zoom,width,height);
   }
 
-  void mouseReleaseEvent(QMouseEvent* event) 
+  QPointF viewToImage(const QPointF& point) const
   {
-    mouseButtonStates[button2id[event->button()]] = Up;
+    QRectF view = viewRect();
+    return QPointF((point.x()-view.x())/zoom,(point.y()-view.y())/zoom);
   }
-    
-  void wheelEvent(QWheelEvent* event)
+
+  // x,y,width,height in image coordinates, the bilinear filter reaches one pixel further
+  QRect mapToView(int x,int y,int width,int height) const
   {
-    wheelDelta = event->delta();
+    QRectF view = viewRect();
+    QRectF rect(view.x()+x*zoom,view.y()+y*zoom,width*zoom,height*zoom);
+
+    return rect.toAlignedRect().adjusted(-1,-1,1,1).intersected(contentsRect());
   }
-  
-public slots:
-  bool widgetResized()
+
+  // shows an image that wraps memory owned by somebody else, without copying it
+  void showImage(const QImage& frame)
+  {
+    bool resized = (frame.size()!=image().size());
+
+    feedImage = frame;
+
+    if (resized) { updateGeometry(); update(); return; }
+
+    update(mapToView(0,0,feedImage.width(),feedImage.height()));
+  }
+
+  void updateImage(int x,int y,int width,int height)
   {
-    return widgetWasResized;
+    QRect dirty = QRect(x,y,width,height).intersected(image().rect());
+
+    if (dirty.isEmpty()) return;
+
+    QRect rect = mapToView(dirty.x(),dirty.y(),dirty.width(),dirty.height());
+
+    if (!rect.isEmpty()) update(rect);
   }
-  
-  bool mouseDown(int button)
+
+  QSize sizeHint() const
   {
-    return mouseButtonStates[button2id[button]]==Down;
+    const QImage& shown = image();
+
+    if (shown.isNull()) return QFrame::sizeHint();
+
+    QRect contents = contentsRect();
+    return QSize((int)ceil(shown.width()*zoom)+width()-contents.width(),(int)ceil(shown.height()*zoom)+height()-contents.height());
   }
 
-  bool mousePressed(int button)
+  void paintEvent(QPaintEvent* event)
   {
-    return mouseButtonStates[button2id[button]]==Pressed;
+    QFrame::paintEvent(event);
+
+    const QImage& shown = image();
+
+    if (shown.isNull()) return;
+
+    QRectF view = viewRect();
+    QRect exposed = event->rect().intersected(contentsRect()).intersected(view.toAlignedRect());
+
+    if (exposed.isEmpty()) return;
+
+    // the source is the exposed part widened to whole image pixels, so that partial repaints sample
+    // the image exactly like full ones do
+    int left = (int)floor((exposed.x()-view.x())/zoom);
+    int top = (int)floor((exposed.y()-view.y())/zoom);
+    int right = (int)ceil((exposed.x()+exposed.width()-view.x())/zoom);
+    int bottom = (int)ceil((exposed.y()+exposed.height()-view.y())/zoom);
+
+    QRect source = QRect(left,top,right-left,bottom-top).intersected(shown.rect());
+
+    if (source.isEmpty()) return;
+
+    QRectF target(view.x()+source.x()*zoom,view.y()+source.y()*zoom,source.width()*zoom,source.height()*zoom);
+
+    QPainter painter(this);
+    painter.setClipRect(exposed);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform,smooth);
+    painter.drawImage(target,shown,QRectF(source));
   }
 
-  bool mouseUp(int button)
+  void resizeEvent(QResizeEvent* event)
   {
-    return mouseButtonStates[button2id[button]]==Up;
+    input.resizeEvent(event);
+    markDirty();
   }
-  
-  int mouseWheelDelta()
+
+  void mousePressEvent(QMouseEvent* event)
+  {
+    input.mousePressEvent(event);
+    markDirty();
+    setFocus(Qt::MouseFocusReason);
+  }
+
+  void mouseReleaseEvent(QMouseEvent* event)
   {
-    return wheelDelta;
+    input.mouseReleaseEvent(event);
+    markDirty();
   }
-  
+
+  void wheelEvent(QWheelEvent* event)
+  {
+    input.wheelEvent(event);
+    markDirty();
+  }
+
   void updateState()
   {
-    widgetWasResized = false;
-    
-    for(int i=0;i<3;i++)
+    input.updateState();
+  }
+};
+
+// Pixmap widget that paints the visible tiles of a tiled image instead of its own buffer
+class IMTiledView : public IMPixmap
+{
+  Q_OBJECT
+public:
+  TiledImage* image;
+  int arrivals;
+
+  IMTiledView()
+  {
+    image = 0;
+    arrivals = 0;
+  }
+
+  // repaints when tiles arrived since the last call
+  void setImage(TiledImage* newImage)
+  {
+    if (image!=newImage)
     {
-      if (mouseButtonStates[i] == Down) mouseButtonStates[i] = Pressed;
-      else if (mouseButtonStates[i] == Up) mouseButtonStates[i] = Released;
+      image = newImage;
+      arrivals = (image!=0) ? tiledImageArrivals(image) : 0;
+
+      updateGeometry();
+      update();
+      return;
     }
 
-    wheelDelta = 0;
+    if (image==0) return;
+
+    int count = tiledImageArrivals(image);
+
+    if (count==arrivals) return;
+
+    arrivals = count;
+    update();
+  }
+
+  QSize imageSize() const
+  {
+    return (image!=0) ? tiledImageSize(image) : QSize();
+  }
+
+  QSize sizeHint() const
+  {
+    return QFrame::sizeHint();
+  }
+
+  void paintEvent(QPaintEvent* event)
+  {
+    QFrame::paintEvent(event);
+
+    if (image==0) return;
+
+    QRectF view = viewRect();
+    QRect exposed = event->rect().intersected(contentsRect()).intersected(view.toAlignedRect());
+
+    if (exposed.isEmpty()) return;
+
+    QPainter painter(this);
+    painter.setClipRect(exposed);
+
+    paintTiledImage(image,painter,view,zoom,exposed,smooth);
   }
 };
 
-class IMFrame : public QFrame
+class GLContextPrivate : public QWidget, public IMWidget
 {
   Q_OBJECT
-public:    
-  bool widgetWasResized;
-  
-  int button2id[5];
+public:
+  QGLWidget* glWidget;
 
-  enum ButtonState
+  IMInputState input;
+
+  GLContextPrivate()
   {
-    Released,Down,Pressed,Up
-  };
-  
-  ButtonState mouseButtonStates[3];
-  int wheelDelta;  
-    
-  IMFrame()
-  {  
-    widgetWasResized = false;
-    
-    button2id[Qt::LeftButton] = 0;
-    button2id[Qt::RightButton] = 1;
-    button2id[Qt::MidButton] = 2;
-    
-    for(int i=0;i<3;i++) mouseButtonStates[i] = Released;    
-    
-    wheelDelta = 0;
-    
-    setMouseTracking(true);     
+    QHBoxLayout* layout = new QHBoxLayout(this);
+    glWidget = new QGLWidget(QGLFormat::defaultFormat());
+//    layout->setSizeConstraint(QLayout::SetMaximumSize);
+    //glWidget->setSizePolicy(QSizePolicy::Ignored,QSizePolicy::Ignored);
+
+    layout->setContentsMargins(0,0,0,0);
+    layout->addWidget(glWidget);
+
+    glWidget->setMouseTracking(true);
+    setMouseTracking(true);
+    //setSizePolicy(QSizePolicy::Ignored,QSizePolicy::Ignored);
   }
-  
+
+  ~GLContextPrivate()
+  {
+    //delete glWidget;
+  }
+
+  void makeCurrent()
+  {
+    glWidget->makeCurrent();
+  }
+
+  void doneCurrent()
+  {
+    glWidget->doneCurrent();
+  }
+
+  void swapBuffers()
+  {
+    glWidget->swapBuffers();
+  }
+
   void resizeEvent(QResizeEvent* event)
   {
-    widgetWasResized = true;
-  }  
+    input.resizeEvent(event);
+    markDirty();
+  }
 
-  void mousePressEvent(QMouseEvent* event) 
+  void mousePressEvent(QMouseEvent* event)
   {
-    mouseButtonStates[button2id[event->button()]] = Down;
+    input.mousePressEvent(event);
+    markDirty();
     setFocus(Qt::MouseFocusReason);
   }
 
-  void mouseReleaseEvent(QMouseEvent* event) 
+  void mouseReleaseEvent(QMouseEvent* event)
   {
-    mouseButtonStates[button2id[event->button()]] = Up;
+    input.mouseReleaseEvent(event);
+    markDirty();
   }
-    
+
   void wheelEvent(QWheelEvent* event)
   {
-    wheelDelta = event->delta();
+    input.wheelEvent(event);
+    markDirty();
   }
-  
-public slots:
-  bool widgetResized()
+
+  void updateState()
   {
-    return widgetWasResized;
+    input.updateState();
   }
+};
 
-  bool mouseDown(int button)
+class IMFrame : public QFrame, public IMWidget
+{
+  Q_OBJECT
+public:
+  IMInputState input;
+
+  IMFrame()
   {
-    return mouseButtonStates[button2id[button]]==Down;
+    setMouseTracking(true);
   }
 
-  bool mousePressed(int button)
+  void resizeEvent(QResizeEvent* event)
   {
-    return mouseButtonStates[button2id[button]]==Pressed;
+    input.resizeEvent(event);
+    markDirty();
   }
 
-  bool mouseUp(int button)
+  void mousePressEvent(QMouseEvent* event)
   {
-    return mouseButtonStates[button2id[button]]==Up;
+    input.mousePressEvent(event);
+    markDirty();
+    setFocus(Qt::MouseFocusReason);
   }
-  
-  int mouseWheelDelta()
+
+  void mouseReleaseEvent(QMouseEvent* event)
   {
-    return wheelDelta;
+    input.mouseReleaseEvent(event);
+    markDirty();
   }
 
-  void updateState()
+  void wheelEvent(QWheelEvent* event)
   {
-    widgetWasResized = false;
-        
-    for(int i=0;i<3;i++)
-    {
-      if (mouseButtonStates[i] == Down) mouseButtonStates[i] = Pressed;
-      else if (mouseButtonStates[i] == Up) mouseButtonStates[i] = Released;
-    }
+    input.wheelEvent(event);
+    markDirty();
+  }
 
-    wheelDelta = 0;        
-  }   
+  void updateState()
+  {
+    input.updateState();
+  }
 };
 #endif